@@ -0,0 +1,58 @@
+// arena the environments of closures that outlive the function creating them
+// are allocated in, declared for Adscript in runtime/prelude.adscript
+//
+// every thread allocates from its own stack of chunks. a mark is the number of
+// bytes the thread allocated so far, releasing it frees everything the thread
+// allocated after the mark was taken.
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define CHUNK_SIZE (64 * 1024)
+
+struct chunk {
+    struct chunk *prev;
+    // mark of the first byte of 'data'
+    int64_t base;
+    int64_t used, size;
+    _Alignas(16) char data[];
+};
+
+static _Thread_local struct chunk *top;
+
+void *adscript_arena_alloc(int64_t size) {
+    size = (size + 15) / 16 * 16;
+
+    if (!top || top->used + size > top->size) {
+        int64_t n = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+        struct chunk *c = malloc(sizeof(*c) + n);
+        if (!c) return NULL;
+
+        c->prev = top;
+        c->base = top ? top->base + top->used : 0;
+        c->used = 0;
+        c->size = n;
+        top = c;
+    }
+
+    void *p = top->data + top->used;
+    top->used += size;
+    return p;
+}
+
+int64_t adscript_arena_mark(void) {
+    return top ? top->base + top->used : 0;
+}
+
+int64_t adscript_arena_release(int64_t mark) {
+    // already released
+    if (mark < 0 || mark > adscript_arena_mark()) return 0;
+
+    while (top && top->base >= mark) {
+        struct chunk *prev = top->prev;
+        free(top);
+        top = prev;
+    }
+    if (top) top->used = mark - top->base;
+    return 1;
+}
@@ -0,0 +1,62 @@
+// single-threaded executor for '^async' functions, declared for Adscript in
+// runtime/prelude.adscript
+//
+// spawned coroutines are resumed in turns (every one until it suspends) until
+// all of them are done, then they are destroyed. a coroutine awaiting another
+// one resumes it itself, so only the tasks that are independent of each other
+// have to be spawned.
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// the frames of coroutines (as split by llvm) start with the function resuming
+// them, which is NULL once they are done, and the one destroying them
+typedef void (*coro_fn)(void *frame);
+
+struct frame {
+    coro_fn resume;
+    coro_fn destroy;
+};
+
+static struct frame **tasks;
+static int64_t ntasks, capacity;
+
+int64_t adscript_async_spawn(struct frame *task) {
+    if (ntasks == capacity) {
+        int64_t c = capacity ? capacity * 2 : 16;
+        struct frame **t = realloc(tasks, c * sizeof(*tasks));
+        if (!t) return 0;
+        tasks = t;
+        capacity = c;
+    }
+
+    tasks[ntasks++] = task;
+    return 1;
+}
+
+// returns the number of tasks that were run
+int64_t adscript_async_run(void) {
+    int64_t n = 0;
+
+    while (ntasks) {
+        // tasks spawned while resuming the others wait for the next round
+        int64_t round = ntasks, left = 0;
+        for (int64_t i = 0; i < round; i++) {
+            struct frame *t = tasks[i];
+            if (t->resume) t->resume(t);
+
+            if (t->resume) {
+                tasks[left++] = t;
+            } else {
+                t->destroy(t);
+                n++;
+            }
+        }
+
+        // keeps the ones spawned in this round
+        for (int64_t i = round; i < ntasks; i++) tasks[left++] = tasks[i];
+        ntasks = left;
+    }
+
+    return n;
+}
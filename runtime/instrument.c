@@ -0,0 +1,236 @@
+// call counts and inclusive time of the functions of modules compiled with
+// '--instrument-functions', written to a file at exit
+//
+// the compiler makes every function that is left after inlining call
+// __cyg_profile_func_enter and __cyg_profile_func_exit and registers their
+// names. every thread counts into its own table, so calls do not synchronize
+// with other threads, the tables are only merged when they are written out.
+
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define NOINSTR __attribute__((no_instrument_function))
+
+struct counter {
+    void *fn;
+    int64_t calls, ns;
+    // number of calls running at the moment, the time of recursive calls is
+    // counted once
+    int64_t active;
+};
+
+// frames of calls whose counter could not be allocated have none, so the
+// exits still match the enters
+struct frame {
+    struct counter *c;
+    int64_t start;
+};
+
+struct table {
+    // open addressing, counters do not move when the table grows
+    struct counter **slots;
+    int64_t mask, size;
+    // frames deeper than 'capacity' (if growing the stack failed) are only
+    // counted in 'depth'
+    struct frame *stack;
+    int64_t depth, capacity;
+    struct table *next;
+};
+
+static _Thread_local struct table *self;
+// the tables of all threads (also the ones that exited)
+static struct table *tables;
+
+// names of the functions of a module, registered by its constructor
+struct module {
+    void **fns;
+    const char **names;
+    int64_t n;
+    struct module *next;
+};
+
+static struct module *modules;
+
+NOINSTR static int64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+NOINSTR static uint64_t hash(void *fn) {
+    return ((uintptr_t) fn >> 4) * 0x9e3779b97f4a7c15;
+}
+
+NOINSTR static struct table *newTable(void) {
+    struct table *t = calloc(1, sizeof(*t));
+    if (!t) return NULL;
+
+    t->mask = 63;
+    t->slots = calloc(t->mask + 1, sizeof(*t->slots));
+    if (!t->slots) {
+        free(t);
+        return NULL;
+    }
+
+    t->next = __atomic_load_n(&tables, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&tables, &t->next, t, 1,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    return self = t;
+}
+
+NOINSTR static int grow(struct table *t) {
+    int64_t mask = t->mask * 2 + 1;
+    struct counter **slots = calloc(mask + 1, sizeof(*slots));
+    if (!slots) return 0;
+
+    for (int64_t i = 0; i <= t->mask; i++) {
+        struct counter *c = t->slots[i];
+        if (!c) continue;
+        uint64_t j = hash(c->fn) & mask;
+        while (slots[j]) j = (j + 1) & mask;
+        slots[j] = c;
+    }
+
+    free(t->slots);
+    t->slots = slots;
+    t->mask = mask;
+    return 1;
+}
+
+NOINSTR static struct counter *lookup(struct table *t, void *fn) {
+    uint64_t i = hash(fn) & t->mask;
+    for (; t->slots[i]; i = (i + 1) & t->mask)
+        if (t->slots[i]->fn == fn) return t->slots[i];
+
+    // at most half full
+    if ((t->size + 1) * 2 > t->mask + 1) {
+        if (!grow(t)) return NULL;
+        return lookup(t, fn);
+    }
+
+    struct counter *c = calloc(1, sizeof(*c));
+    if (!c) return NULL;
+    c->fn = fn;
+    t->slots[i] = c;
+    t->size++;
+    return c;
+}
+
+NOINSTR void __cyg_profile_func_enter(void *fn, void *site) {
+    struct table *t = self ? self : newTable();
+    if (!t) return;
+
+    if (t->depth == t->capacity) {
+        int64_t capacity = t->capacity ? t->capacity * 2 : 64;
+        struct frame *stack = realloc(t->stack, capacity * sizeof(*stack));
+        if (stack) {
+            t->stack = stack;
+            t->capacity = capacity;
+        }
+    }
+
+    // a frame is pushed for every call, the exit pops it
+    int64_t depth = t->depth++;
+    if (depth >= t->capacity) return;
+
+    struct counter *c = lookup(t, fn);
+    t->stack[depth].c = c;
+    if (!c) return;
+
+    c->calls++;
+    t->stack[depth].start = c->active++ ? 0 : now();
+}
+
+NOINSTR void __cyg_profile_func_exit(void *fn, void *site) {
+    struct table *t = self;
+    if (!t || !t->depth) return;
+
+    int64_t depth = --t->depth;
+    if (depth >= t->capacity) return;
+
+    struct frame *f = &t->stack[depth];
+    if (f->c && !--f->c->active) f->c->ns += now() - f->start;
+}
+
+NOINSTR static const char *nameOf(void *fn) {
+    for (struct module *m = modules; m; m = m->next)
+        for (int64_t i = 0; i < m->n; i++)
+            if (m->fns[i] == fn) return m->names[i];
+    return NULL;
+}
+
+NOINSTR static int byFn(const void *a, const void *b) {
+    void *x = (*(struct counter **) a)->fn, *y = (*(struct counter **) b)->fn;
+    return x < y ? -1 : x > y;
+}
+
+NOINSTR static int byTime(const void *a, const void *b) {
+    int64_t x = (*(struct counter **) a)->ns, y = (*(struct counter **) b)->ns;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// merges the counters of all threads and writes them to ADSCRIPT_CALLS
+// ('adscript-calls.txt' by default), by inclusive time
+NOINSTR static void dump(void) {
+    int64_t n = 0;
+    for (struct table *t = tables; t; t = t->next) n += t->size;
+
+    struct counter **all = malloc((n ? n : 1) * sizeof(*all));
+    if (!all) return;
+
+    n = 0;
+    for (struct table *t = tables; t; t = t->next)
+        for (int64_t i = 0; i <= t->mask; i++)
+            if (t->slots[i]) all[n++] = t->slots[i];
+
+    // the first counter of every function gets the counts of the others
+    qsort(all, n, sizeof(*all), byFn);
+    int64_t merged = 0;
+    for (int64_t i = 0; i < n; i++) {
+        if (merged && all[merged - 1]->fn == all[i]->fn) {
+            all[merged - 1]->calls += all[i]->calls;
+            all[merged - 1]->ns += all[i]->ns;
+        } else {
+            all[merged++] = all[i];
+        }
+    }
+    qsort(all, merged, sizeof(*all), byTime);
+
+    const char *path = getenv("ADSCRIPT_CALLS");
+    FILE *out = fopen(path ? path : "adscript-calls.txt", "w");
+    if (!out) {
+        free(all);
+        return;
+    }
+
+    fprintf(out, "%12s %14s  %s\n", "calls", "inclusive ms", "function");
+    for (int64_t i = 0; i < merged; i++) {
+        const char *name = nameOf(all[i]->fn);
+        fprintf(out, "%12lld %14.3f  ", (long long) all[i]->calls,
+            all[i]->ns / 1e6);
+        if (name) fprintf(out, "%s\n", name);
+        else fprintf(out, "%p\n", all[i]->fn);
+    }
+
+    fclose(out);
+    free(all);
+}
+
+NOINSTR int64_t adscript_instrument_register(void **fns, const char **names,
+        int64_t n) {
+    struct module *m = malloc(sizeof(*m));
+    if (!m) return 0;
+
+    // constructors run before the threads are started
+    if (!modules) atexit(dump);
+
+    m->fns = fns;
+    m->names = names;
+    m->n = n;
+    m->next = modules;
+    modules = m;
+    return 1;
+}
@@ -0,0 +1,291 @@
+// work-stealing thread pool 'parallel-for' (and 'pmap') and 'spawn'/'sync' are
+// lowered to
+//
+// every worker owns a chase-lev deque of tasks, it pushes and takes tasks at
+// the bottom of it while idle workers steal from the top of the others. ranges
+// are split lazily (only while the part split off last was taken by someone),
+// so the grain size adapts to how busy the other workers are.
+//
+// spawned tasks are pushed for others to steal (while the spawning function
+// goes on) unless there are enough tasks to steal already, then they run
+// right away, so small subproblems deep down the recursion run serially.
+//
+// ADSCRIPT_THREADS sets the number of workers (the number of cores by
+// default), including the thread calling into the runtime.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+
+typedef void (*body_fn)(void *env, int64_t lo, int64_t hi);
+
+// tasks of one parallel-for (or spawned by one function) that are not done yet
+struct job {
+    int64_t pending;
+    // whether the job was announced to the idle workers (and a thread that is
+    // not a worker is worker 0 for it), only used for spawned tasks
+    int64_t started;
+};
+
+// runs 'fn' for [lo, hi) in chunks of 'grain' iterations
+struct task {
+    body_fn fn;
+    void *env;
+    int64_t lo, hi, grain;
+    struct job *job;
+};
+
+#define DEQUE_SIZE 1024
+
+// spawned tasks run right away if the deque of the worker is this full
+#define SPAWN_CUTOFF 8
+
+struct worker {
+    _Alignas(64) int64_t top;
+    _Alignas(64) int64_t bottom;
+    struct task tasks[DEQUE_SIZE];
+    unsigned seed;
+};
+
+static int nworkers;
+static struct worker *workers;
+static __thread struct worker *self;
+
+// threads that are not workers run their parallel-fors (and functions
+// spawning tasks) as worker 0, one at a time
+static pthread_mutex_t externalLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int externalJobs;
+
+// workers sleep while no parallel-for is running
+static int64_t active;
+static pthread_mutex_t idleLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idleCond = PTHREAD_COND_INITIALIZER;
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+// thieves may read a slot while it is written, the task they read is only
+// used if they win the race for it though
+static void storeTask(struct task *slot, const struct task *t) {
+    __atomic_store_n(&slot->fn, t->fn, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->env, t->env, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->lo, t->lo, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->hi, t->hi, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->grain, t->grain, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->job, t->job, __ATOMIC_RELAXED);
+}
+
+static void loadTask(struct task *t, struct task *slot) {
+    t->fn = __atomic_load_n(&slot->fn, __ATOMIC_RELAXED);
+    t->env = __atomic_load_n(&slot->env, __ATOMIC_RELAXED);
+    t->lo = __atomic_load_n(&slot->lo, __ATOMIC_RELAXED);
+    t->hi = __atomic_load_n(&slot->hi, __ATOMIC_RELAXED);
+    t->grain = __atomic_load_n(&slot->grain, __ATOMIC_RELAXED);
+    t->job = __atomic_load_n(&slot->job, __ATOMIC_RELAXED);
+}
+
+static int64_t size(struct worker *w) {
+    return __atomic_load_n(&w->bottom, __ATOMIC_RELAXED)
+        - __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+}
+
+static int push(struct worker *w, const struct task *t) {
+    int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+    if (b - top >= DEQUE_SIZE) return 0;
+
+    storeTask(&w->tasks[b % DEQUE_SIZE], t);
+    __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static int take(struct worker *w, struct task *t) {
+    int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+
+    if (top > b) {
+        __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    loadTask(t, &w->tasks[b % DEQUE_SIZE]);
+    if (top < b) return 1;
+
+    // the last task, thieves may race for it
+    int won = __atomic_compare_exchange_n(&w->top, &top, top + 1, 0,
+        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+    return won;
+}
+
+static int steal(struct worker *w, struct task *t) {
+    int64_t top = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+    if (top >= b) return 0;
+
+    loadTask(t, &w->tasks[top % DEQUE_SIZE]);
+    return __atomic_compare_exchange_n(&w->top, &top, top + 1, 0,
+        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static int stealAny(struct worker *w, struct task *t) {
+    for (int i = 0; i < nworkers; i++) {
+        struct worker *victim = &workers[rand_r(&w->seed) % nworkers];
+        if (victim != w && steal(victim, t)) return 1;
+    }
+    return 0;
+}
+
+static void run(struct worker *w, struct task t) {
+    while (t.lo < t.hi) {
+        // give away the upper half while the last given away part was taken
+        if (t.hi - t.lo > t.grain && size(w) == 0) {
+            struct task half = t;
+            half.lo = t.lo + (t.hi - t.lo) / 2;
+
+            __atomic_add_fetch(&t.job->pending, 1, __ATOMIC_RELAXED);
+            if (push(w, &half)) {
+                t.hi = half.lo;
+                continue;
+            }
+            __atomic_sub_fetch(&t.job->pending, 1, __ATOMIC_RELAXED);
+        }
+
+        int64_t hi = t.hi - t.lo > t.grain ? t.lo + t.grain : t.hi;
+        t.fn(t.env, t.lo, hi);
+        t.lo = hi;
+    }
+
+    __atomic_sub_fetch(&t.job->pending, 1, __ATOMIC_RELEASE);
+}
+
+static void idle(void) {
+    if (__atomic_load_n(&active, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+        return;
+    }
+
+    pthread_mutex_lock(&idleLock);
+    while (!__atomic_load_n(&active, __ATOMIC_ACQUIRE))
+        pthread_cond_wait(&idleCond, &idleLock);
+    pthread_mutex_unlock(&idleLock);
+}
+
+static void *workerMain(void *arg) {
+    struct worker *w = arg;
+    self = w;
+
+    for (;;) {
+        struct task t;
+        if (take(w, &t) || stealAny(w, &t)) run(w, t);
+        else idle();
+    }
+
+    return NULL;
+}
+
+static void start(void) {
+    char *threads = getenv("ADSCRIPT_THREADS");
+    nworkers = threads ? atoi(threads) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers < 1) nworkers = 1;
+
+    workers = aligned_alloc(64, sizeof(struct worker) * nworkers);
+    for (int i = 0; i < nworkers; i++) {
+        workers[i].top = workers[i].bottom = 0;
+        workers[i].seed = i + 1;
+    }
+
+    for (int i = 1; i < nworkers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, workerMain, &workers[i])) {
+            // run with the workers that could be started
+            nworkers = i;
+            break;
+        }
+        pthread_detach(thread);
+    }
+}
+
+// makes the calling thread a worker (if it is not) and wakes up the others
+static void startJob(void) {
+    if (!self || externalJobs) {
+        if (!externalJobs++) {
+            pthread_mutex_lock(&externalLock);
+            self = &workers[0];
+        }
+    }
+
+    // the workers only sleep while nothing is running
+    if (__atomic_fetch_add(&active, 1, __ATOMIC_RELEASE)) return;
+
+    pthread_mutex_lock(&idleLock);
+    pthread_cond_broadcast(&idleCond);
+    pthread_mutex_unlock(&idleLock);
+}
+
+// helps the others until every task of 'job' is done
+static void finishJob(struct job *job) {
+    while (__atomic_load_n(&job->pending, __ATOMIC_ACQUIRE)) {
+        struct task other;
+        if (take(self, &other) || stealAny(self, &other)) run(self, other);
+        else sched_yield();
+    }
+
+    __atomic_sub_fetch(&active, 1, __ATOMIC_RELEASE);
+
+    if (externalJobs && !--externalJobs) {
+        self = NULL;
+        pthread_mutex_unlock(&externalLock);
+    }
+}
+
+void adscript_parallel_for(body_fn fn, void *env, int64_t lo, int64_t hi) {
+    if (lo >= hi) return;
+
+    pthread_once(&once, start);
+    if (nworkers == 1 || hi - lo == 1) {
+        fn(env, lo, hi);
+        return;
+    }
+
+    // small enough chunks to check for idle workers often
+    int64_t grain = (hi - lo) / (64 * (int64_t)nworkers);
+    struct job job = { 1, 1 };
+    struct task t = { fn, env, lo, hi, grain < 1 ? 1 : grain, &job };
+
+    startJob();
+    run(self, t);
+    finishJob(&job);
+}
+
+// 'frame' is the zero-initialized job of the function spawning 'fn'
+void adscript_spawn(body_fn fn, void *env, struct job *frame) {
+    pthread_once(&once, start);
+    if (nworkers == 1) {
+        fn(env, 0, 1);
+        return;
+    }
+
+    if (!frame->started) {
+        frame->started = 1;
+        startJob();
+    }
+
+    struct task t = { fn, env, 0, 1, 1, frame };
+    __atomic_add_fetch(&frame->pending, 1, __ATOMIC_RELAXED);
+    if (size(self) >= SPAWN_CUTOFF || !push(self, &t)) {
+        __atomic_sub_fetch(&frame->pending, 1, __ATOMIC_RELAXED);
+        fn(env, 0, 1);
+    }
+}
+
+void adscript_sync(struct job *frame) {
+    if (!frame->started) return;
+
+    finishJob(frame);
+    frame->started = 0;
+}
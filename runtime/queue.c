@@ -0,0 +1,156 @@
+// bounded queues of 64 bit values for passing messages between threads,
+// declared for Adscript in runtime/prelude.adscript
+//
+// 'spsc' is a ring buffer for one producer and one consumer thread, 'mpmc' a
+// queue any number of threads can push to and pop from. capacities are
+// rounded up to a power of two. pushing to a full and popping from an empty
+// queue fail (return 0) instead of blocking.
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// rounded up to a power of two, at least 2
+static int64_t capacityOf(int64_t capacity) {
+    int64_t c = 2;
+    while (c < capacity) c *= 2;
+    return c;
+}
+
+// zeroed, with the size rounded up to a multiple of the cache line size
+static void *allocLines(size_t size) {
+    size = (size + 63) / 64 * 64;
+    char *p = aligned_alloc(64, size);
+    if (p) for (size_t i = 0; i < size; i++) p[i] = 0;
+    return p;
+}
+
+// every index is written by one side only and read by the other, on its own
+// cache line. both sides keep a copy of the index of the other one and only
+// reload it when the queue looks full (or empty) to them
+struct spsc {
+    _Alignas(64) int64_t head;
+    int64_t tailCache;
+    _Alignas(64) int64_t tail;
+    int64_t headCache;
+    _Alignas(64) int64_t mask;
+    int64_t slots[];
+};
+
+struct spsc *adscript_spsc_new(int64_t capacity) {
+    capacity = capacityOf(capacity);
+
+    struct spsc *q = allocLines(sizeof(struct spsc) + capacity * sizeof(int64_t));
+    if (q) q->mask = capacity - 1;
+    return q;
+}
+
+int64_t adscript_spsc_push(struct spsc *q, int64_t v) {
+    int64_t tail = q->tail;
+    if (tail - q->headCache > q->mask) {
+        q->headCache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        if (tail - q->headCache > q->mask) return 0;
+    }
+
+    q->slots[tail & q->mask] = v;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int64_t adscript_spsc_pop(struct spsc *q, int64_t *v) {
+    int64_t head = q->head;
+    if (head == q->tailCache) {
+        q->tailCache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        if (head == q->tailCache) return 0;
+    }
+
+    *v = q->slots[head & q->mask];
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int64_t adscript_spsc_free(struct spsc *q) {
+    free(q);
+    return 0;
+}
+
+// every cell has a sequence number telling whose turn it is: a producer may
+// fill it when it is the position it pushes to, a consumer may empty it when it
+// is one more than the position it pops from
+struct cell {
+    int64_t seq;
+    int64_t val;
+};
+
+struct mpmc {
+    _Alignas(64) int64_t head;
+    _Alignas(64) int64_t tail;
+    _Alignas(64) int64_t mask;
+    struct cell cells[];
+};
+
+struct mpmc *adscript_mpmc_new(int64_t capacity) {
+    capacity = capacityOf(capacity);
+
+    struct mpmc *q = allocLines(sizeof(struct mpmc) + capacity * sizeof(struct cell));
+    if (!q) return NULL;
+
+    q->mask = capacity - 1;
+    for (int64_t i = 0; i < capacity; i++) q->cells[i].seq = i;
+    return q;
+}
+
+int64_t adscript_mpmc_push(struct mpmc *q, int64_t v) {
+    int64_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    struct cell *c;
+
+    for (;;) {
+        c = &q->cells[pos & q->mask];
+        int64_t diff = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - pos;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            // the consumer of the last round did not empty it yet
+            return 0;
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    c->val = v;
+    __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int64_t adscript_mpmc_pop(struct mpmc *q, int64_t *v) {
+    int64_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    struct cell *c;
+
+    for (;;) {
+        c = &q->cells[pos & q->mask];
+        int64_t diff = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (pos + 1);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            // not filled yet
+            return 0;
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    *v = c->val;
+    // free for the producer of the next round
+    __atomic_store_n(&c->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int64_t adscript_mpmc_free(struct mpmc *q) {
+    free(q);
+    return 0;
+}
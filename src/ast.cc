@@ -1,7 +1,9 @@
 #include "ast.hh"
 #include "compiler.hh"
+#include "trace.hh"
 #include "utils.hh"
 
+#include <functional>
 #include <iostream>
 
 #include <llvm/IR/Verifier.h>
@@ -31,12 +33,47 @@ std::u32string AST::PrimType::str() {
 }
 
 std::u32string AST::PointerType::str() {
-  return std::u32string() + U"PointerType: " + type->str();
+  return std::u32string() + U"PointerType: " + type->str() +
+         (restrict ? U" restrict" : U"");
 }
 
 std::u32string AST::StructType::str() {
   return std::u32string() + U"StructType: { " + U"attrs: " +
-         attrMapToStr(attrs) + U" }";
+         argVectorToStr(attrs) + (packed ? U", packed" : U"") +
+         (align ? U", align: " + std::stou32(std::to_string(align)) : U"") +
+         U" }";
+}
+
+std::u32string AST::SoaType::str() {
+  return std::u32string() + U"SoaType: " + type->str();
+}
+
+std::u32string AST::ClosureType::str() {
+  std::u32string s = U"ClosureType: { args: [ ";
+  for (auto &arg : args)
+    s += arg->str() + U" ";
+  return s + U"], retType: " + retType->str() + U" }";
+}
+
+std::u32string AST::AsyncType::str() {
+  return std::u32string() + U"AsyncType: { " + U"type: " + type->str() + U" }";
+}
+
+void AST::PointerType::bind(llvm::Type *t,
+                            std::map<std::string, llvm::Type *> &params) {
+  for (int i = 0; i < quantity; i++) {
+    if (!t->isPointerTy())
+      return;
+    t = t->getPointerElementType();
+  }
+  type->bind(t, params);
+}
+
+void AST::IdentifierType::bind(llvm::Type *t,
+                               std::map<std::string, llvm::Type *> &params) {
+  auto it = params.find(id);
+  if (it != params.end() && !it->second)
+    it->second = t;
 }
 
 std::u32string AST::IdentifierType::str() {
@@ -87,6 +124,14 @@ std::u32string AST::Deft::str() {
   +U", type: " + type->str() + U" }";
 }
 
+std::u32string AST::NativeLLVM::str() {
+  return std::u32string() + U"NativeLLVM: { " + U"ir: \"" + ir + U"\" }";
+}
+
+std::u32string AST::NativeC::str() {
+  return std::u32string() + U"NativeC: { " + U"code: \"" + code + U"\" }";
+}
+
 std::u32string AST::Let::str() {
   return std::u32string() + U"Def: {" + U"id: '" + std::stou32(id) + U"'";
   +U", val: " + val->str() + U" }";
@@ -111,6 +156,20 @@ std::u32string AST::Ref::str() {
   return std::u32string() + U"Ref: {" + U"val: " + val->str() + U" }";
 }
 
+std::u32string AST::Atomic::str() {
+  const char32_t *names[] = {U"atomic-load", U"atomic-store", U"atomic-swap",
+                             U"cas",         U"fetch-add",    U"fetch-sub",
+                             U"fetch-and",   U"fetch-or",     U"fetch-xor",
+                             U"fence"};
+  std::u32string ordersStr;
+  for (auto order : orders)
+    ordersStr += (ordersStr.empty() ? U"" : U", ") +
+                 std::stou32(llvm::toIRString(order));
+  return std::u32string() + U"Atomic: { " + U"op: " + names[at] +
+         U", args: " + AST::exprVectorToStr(args) + U", orders: [" +
+         ordersStr + U"] }";
+}
+
 std::u32string AST::Deref::str() {
   return std::u32string() + U"Deref: {" + U"ptr: " + ptr->str() + U" }";
 }
@@ -120,14 +179,73 @@ std::u32string AST::HeGet::str() {
          ptr->str() + U", idx: " + idx->str() + U" }";
 }
 
+std::u32string AST::Get::str() {
+  return std::u32string() + U"Get: { " + U"ptr: " + ptr->str() + U", field: " +
+         std::stou32(field) + U" }";
+}
+
+std::u32string AST::SoaSize::str() {
+  return std::u32string() + U"SoaSize: { " + U"type: " + type->str() +
+         U", n: " + n->str() + U" }";
+}
+
+std::u32string AST::SoaInit::str() {
+  return std::u32string() + U"SoaInit: { " + U"soa: " + soa->str() +
+         U", buf: " + buf->str() + U", n: " + n->str() + U" }";
+}
+
+std::u32string AST::ParallelFor::str() {
+  return std::u32string() + U"ParallelFor: { " + U"id: " + std::stou32(id) +
+         U", start: " + start->str() + U", end: " + end->str() +
+         U", body: " + AST::exprVectorToStr(body) + U" }";
+}
+
+std::u32string AST::Spawn::str() {
+  return std::u32string() + U"Spawn: { " + U"expr: " + expr->str() + U" }";
+}
+
+std::u32string AST::Sync::str() { return U"Sync"; }
+
+std::u32string AST::While::str() {
+  return std::u32string() + U"While: { " + U"cond: " + cond->str() +
+         U", body: " + AST::exprVectorToStr(body) + U" }";
+}
+
+std::u32string AST::Yield::str() {
+  return std::u32string() + U"Yield: { " +
+         (val ? U"val: " + val->str() + U" " : U"") + U"}";
+}
+
+std::u32string AST::Await::str() {
+  return std::u32string() + U"Await: { " + U"handle: " + handle->str() + U" }";
+}
+
+std::u32string AST::Coro::str() {
+  const char32_t *names[] = {U"resume", U"promise", U"destroy"};
+  return std::u32string() + U"Coro: { " + U"op: " + names[ct] +
+         U", handle: " + handle->str() + U" }";
+}
+
+std::u32string AST::TypeInfo::str() {
+  const char32_t *names[] = {U"sizeof", U"alignof", U"offsetof"};
+  return std::u32string() + U"TypeInfo: { " + U"op: " + names[tit] +
+         U", type: " + type->str() +
+         (field.empty() ? U"" : U", field: " + std::stou32(field)) + U" }";
+}
+
 std::u32string AST::Cast::str() {
   return std::u32string() + U"Cast { " + U"type: " + type->str() + U", expr: " +
          expr->str() + U" }";
 }
 
 std::u32string AST::Function::str() {
+  std::u32string params;
+  for (auto &param : typeParams)
+    params += (params.empty() ? U"" : U" ") + std::stou32(param);
+
   return std::u32string() + U"Function: { " + U"id: '" + std::stou32(id) +
-         U"'" + U", args: " + AST::argVectorToStr(args) + U", type: " +
+         U"'" + (params.empty() ? U"" : U", type params: <" + params + U">") +
+         U", args: " + AST::argVectorToStr(args) + U", type: " +
          retType->str() + U", body: " + AST::exprVectorToStr(body) + U" }";
 }
 
@@ -174,12 +292,103 @@ llvm::Type *AST::PointerType::llvmType(Compiler::Context &ctx) {
 }
 
 llvm::Type *AST::StructType::llvmType(Compiler::Context &ctx) {
+  if (llvmT)
+    return llvmT;
+
+  auto &c = ctx.mod->getContext();
+  auto &dl = ctx.mod->getDataLayout();
   std::vector<llvm::Type *> llvmAttrs;
+  Compiler::Context::StructInfo info;
+  unsigned align = this->align;
+
+  for (auto &attr : attrs) {
+    auto t = attr.second->llvmType(ctx);
+
+    // fields of aligned struct types are put at a multiple of their alignment
+    // by padding without a name in front of them, the struct is aligned to it
+    // as well
+    unsigned fieldAlign = ctx.getAlign(t);
+    if (!packed && fieldAlign > dl.getABITypeAlignment(t)) {
+      // the end of the fields before it
+      auto prefix = llvmAttrs;
+      prefix.push_back(llvm::Type::getInt8Ty(c));
+      uint64_t end = dl.getStructLayout(llvm::StructType::get(c, prefix))
+                         ->getElementOffset(llvmAttrs.size());
+      uint64_t offset = llvm::alignTo(end, fieldAlign);
+      if (offset > end) {
+        llvmAttrs.push_back(
+            llvm::ArrayType::get(llvm::Type::getInt8Ty(c), offset - end));
+        info.fields.push_back("");
+      }
+      align = std::max(align, fieldAlign);
+    }
 
-  for (auto &attr : attrs)
-    llvmAttrs.push_back(attr.second->llvmType(ctx));
+    llvmAttrs.push_back(t);
+    info.fields.push_back(attr.first);
+  }
+  info.align = align;
+
+  // pad the struct to a multiple of its alignment, so every element of an
+  // array of it is aligned too (the layout of a type is cached once it is
+  // computed, so it is computed for a literal struct with the same fields)
+  if (align) {
+    uint64_t size =
+        dl.getTypeAllocSize(llvm::StructType::get(c, llvmAttrs, packed))
+            .getFixedSize();
+    uint64_t padded = llvm::alignTo(size, align);
+    if (padded > size)
+      llvmAttrs.push_back(
+          llvm::ArrayType::get(llvm::Type::getInt8Ty(c), padded - size));
+  }
 
-  return llvm::StructType::get(ctx.mod->getContext(), llvmAttrs);
+  // named by 'deft'
+  llvmT = llvm::StructType::create(c, llvmAttrs, "struct", packed);
+
+  ctx.structs[llvmT] = info;
+  return llvmT;
+}
+
+llvm::Type *AST::ClosureType::llvmType(Compiler::Context &ctx) {
+  auto envT = llvm::Type::getInt8PtrTy(ctx.mod->getContext());
+
+  std::vector<llvm::Type *> ftArgs = {envT};
+  for (auto &arg : args)
+    ftArgs.push_back(arg->llvmType(ctx));
+
+  auto ft = llvm::FunctionType::get(retType->llvmType(ctx), ftArgs, false);
+  return llvm::StructType::get(ft->getPointerTo(), envT);
+}
+
+llvm::Type *AST::SoaType::llvmType(Compiler::Context &ctx) {
+  if (llvmT)
+    return llvmT;
+
+  auto elemT = llvm::dyn_cast<llvm::StructType>(type->llvmType(ctx));
+  if (!elemT || !ctx.structs.count(elemT) || ctx.soas.count(elemT))
+    Error::compiler(U"expected struct type for soa collection");
+
+  // one array per field (without the padding of aligned structs, the padding
+  // in front of aligned fields takes no space)
+  std::vector<llvm::Type *> arrays;
+  auto info = ctx.structs[elemT];
+  auto emptyT = llvm::ArrayType::get(
+      llvm::Type::getInt8Ty(ctx.mod->getContext()), 0);
+  for (size_t i = 0; i < info.fields.size(); i++)
+    arrays.push_back((info.fields[i].empty() ? emptyT
+                                              : elemT->getElementType(i))
+                         ->getPointerTo());
+  info.align = 0;
+
+  // named by 'deft'
+  llvmT = llvm::StructType::create(ctx.mod->getContext(), arrays, "soa");
+
+  ctx.structs[llvmT] = info;
+  ctx.soas[llvmT] = elemT;
+  return llvmT;
+}
+
+llvm::Type *AST::AsyncType::llvmType(Compiler::Context &ctx) {
+  return ctx.getAsyncType(type->llvmType(ctx));
 }
 
 llvm::Type *AST::IdentifierType::llvmType(Compiler::Context &ctx) {
@@ -203,6 +412,8 @@ llvm::Value *AST::Char::llvmValue(Compiler::Context &ctx) {
 }
 
 llvm::Value *AST::Identifier::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
   // get var out of context
   if (ctx.isVar(val)) {
     auto var = ctx.varScope[val];
@@ -212,7 +423,12 @@ llvm::Value *AST::Identifier::llvmValue(Compiler::Context &ctx) {
       return var.second;
 
     // return load to alloca
-    return ctx.builder->CreateLoad(var.first, var.second);
+    auto load = ctx.builder->CreateLoad(var.first, var.second);
+
+    // variables captured by reference are accessed through a pointer
+    if (!llvm::isa<llvm::AllocaInst>(var.second))
+      ctx.addTBAA(load);
+    return load;
   } else if (ctx.isFinal(val)) {
     return ctx.needsRef ? ctx.finalScope[val].second
                         : ctx.builder->CreateLoad(ctx.finalScope[val].first,
@@ -255,6 +471,8 @@ llvm::Value *AST::String::llvmValue(Compiler::Context &ctx) {
 }
 
 llvm::Value *AST::UExpr::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
   // get llvm value for expr
   auto v = expr->llvmValue(ctx);
 
@@ -289,6 +507,8 @@ llvm::Value *AST::UExpr::llvmValue(Compiler::Context &ctx) {
 }
 
 llvm::Value *AST::BinExpr::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
   // get llvm values
   auto lv = left->llvmValue(ctx);
   auto rv = right->llvmValue(ctx);
@@ -408,6 +628,8 @@ llvm::Value *AST::BinExpr::llvmValue(Compiler::Context &ctx) {
 }
 
 llvm::Value *AST::If::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
   // get condition llvm value
   auto condV = createLogicalVal(ctx, cond->llvmValue(ctx));
 
@@ -447,6 +669,8 @@ llvm::Value *AST::If::llvmValue(Compiler::Context &ctx) {
 }
 
 llvm::Value *AST::HoArray::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
   // create llvm value vector for array elements
   std::vector<llvm::Constant *> constants;
   std::vector<std::pair<size_t, llvm::Value *>> values;
@@ -483,6 +707,7 @@ llvm::Value *AST::HoArray::llvmValue(Compiler::Context &ctx) {
 
   auto arr = new llvm::GlobalVariable(
       *(ctx.mod), arrT, false, llvm::GlobalValue::PrivateLinkage, initializer);
+  arr->setAlignment(llvm::Align(ctx.getAlign(elementT)));
 
   auto zero = Compiler::constInt(ctx, 0);
   for (auto &pair : values) {
@@ -496,22 +721,29 @@ llvm::Value *AST::HoArray::llvmValue(Compiler::Context &ctx) {
 }
 
 llvm::Value *AST::HeArray::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
   // create llvm value vector for array elements
   std::vector<llvm::Value *> elements;
+  std::vector<llvm::Type *> types;
 
   for (auto &expr : exprs) {
     // get llvm value for the element
     auto v = expr->llvmValue(ctx);
 
-    // create pointer for storing the element's data
-    auto ptr = ctx.builder->CreateAlloca(v->getType());
+    elements.push_back(v);
+    types.push_back(v->getType());
+  }
 
-    // store the element's data into the pointer
-    ctx.builder->CreateStore(v, ptr);
+  // store the elements unboxed in a single tuple, allocated once in the entry
+  // block (the literal may be in a loop)
+  auto f = ctx.builder->GetInsertBlock()->getParent();
+  auto tupleT = llvm::StructType::get(ctx.mod->getContext(), types);
+  auto tuple = Compiler::createAlloca(f, tupleT, ctx.getAlign(tupleT));
 
-    // add the pointer to the 'elements' vector
-    elements.push_back(ptr);
-  }
+  for (size_t i = 0; i < elements.size(); i++)
+    ctx.builder->CreateStore(elements[i],
+                             ctx.builder->CreateStructGEP(tupleT, tuple, i));
 
   // create the array's element type (void*)
   auto t = llvm::Type::getVoidTy(ctx.mod->getContext())->getPointerTo();
@@ -520,24 +752,33 @@ llvm::Value *AST::HeArray::llvmValue(Compiler::Context &ctx) {
   auto arrT = llvm::ArrayType::get(t, elements.size());
 
   // create the array
-  auto arr = (llvm::Value *)ctx.builder->CreateAlloca(arrT);
+  auto alloca = Compiler::createAlloca(f, arrT);
+  auto he = std::make_shared<Compiler::Context::HeTuple>();
+  he->array = alloca;
+  he->tuple = tuple;
 
   // assign 'arr' to the pointer to the first element of the array
-  arr = ctx.builder->CreateGEP(
-      arr, {Compiler::constInt(ctx, 0), Compiler::constInt(ctx, 0)});
+  auto arr = ctx.builder->CreateGEP(
+      alloca, {Compiler::constInt(ctx, 0), Compiler::constInt(ctx, 0)});
 
-  // store all the elements into the array
+  // the array itself points to the elements in the tuple, it is only needed
+  // for indices that are not known at compile time and when it is passed on
   for (size_t i = 0; i < elements.size(); i++) {
     auto ptr = ctx.builder->CreateGEP(arr, Compiler::constInt(ctx, i));
 
-    ctx.builder->CreateStore(cast(ctx, elements[i], t), ptr);
+    he->init.push_back(ctx.builder->CreateStore(
+        cast(ctx, ctx.builder->CreateStructGEP(tupleT, tuple, i), t), ptr));
   }
 
+  ctx.heTuples[arr] = he;
+
   // return the array
   return arr;
 }
 
 llvm::Value *AST::Deft::llvmValue(Compiler::Context &ctx) {
+  Trace::Scope scope("deft", id);
+
   // error if variable is already defined
   if (ctx.isType(id))
     Error::warning(U"data type '" + std::stou32(id) + U"' already defined");
@@ -551,20 +792,39 @@ llvm::Value *AST::Deft::llvmValue(Compiler::Context &ctx) {
   // get llvm value for the stored value
   auto t = type->llvmType(ctx);
 
+  auto st = llvm::dyn_cast<llvm::StructType>(t);
+  if (st && !st->isLiteral())
+    st->setName(id);
+
   // add the alloca to the 'vars' map
   ctx.types[id] = t;
+  ctx.addSignature(id, t);
 
   // return the alloca
   return constInt(ctx, 0);
 }
 
+llvm::Value *AST::NativeLLVM::llvmValue(Compiler::Context &ctx) {
+  Trace::Scope scope("native-llvm", "");
+  ctx.linkIR(std::to_string(ir));
+  return constInt(ctx, 0);
+}
+
+llvm::Value *AST::NativeC::llvmValue(Compiler::Context &ctx) {
+  Trace::Scope scope("native-c", "");
+  ctx.linkC(std::to_string(code));
+  return constInt(ctx, 0);
+}
+
 llvm::Value *AST::Let::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
   // error if variable is already defined
   if (ctx.isFinal(id))
     Error::warning(U"constant '" + std::stou32(id) + U"' already defined");
   else if (ctx.isType(id))
     Error::warning(U"'" + std::stou32(id) + U"' already defined as data type");
-  else if (ctx.isVar(id))
+  else if (ctx.varScope.count(id))
     Error::warning(U"'" + std::stou32(id) + U"' already defined as variable");
   else if (ctx.isFunction(id))
     Error::warning(U"'" + std::stou32(id) + U"' already defined as function");
@@ -579,8 +839,11 @@ llvm::Value *AST::Let::llvmValue(Compiler::Context &ctx) {
 }
 
 llvm::Value *AST::Var::llvmValue(Compiler::Context &ctx) {
-  // error if variable is already defined
-  if (ctx.isVar(id))
+  Compiler::LocScope loc(ctx, this);
+
+  // error if variable is already defined (variables of enclosing functions
+  // can be shadowed in lambdas)
+  if (ctx.varScope.count(id))
     Error::compiler(U"variable '" + std::stou32(id) + U"' already defined");
   else if (ctx.isFinal(id))
     Error::warning(U"'" + std::stou32(id) + U"' already defined as constant");
@@ -592,12 +855,18 @@ llvm::Value *AST::Var::llvmValue(Compiler::Context &ctx) {
   // get llvm value for the stored value
   auto v = val->llvmValue(ctx);
 
-  // create alloca for storing the the value
-  auto alloca = ctx.builder->CreateAlloca(v->getType());
+  // create alloca for storing the the value in the entry block, so a variable
+  // declared in a loop doesn't grow the stack on every iteration
+  auto alloca = Compiler::createAlloca(ctx.builder->GetInsertBlock()->getParent(),
+                                       v->getType(), ctx.getAlign(v->getType()));
 
   // store the value
   ctx.builder->CreateStore(v, alloca);
 
+  // keep track of the tuple of a heterogeneous array stored in it
+  if (ctx.heTuples.count(v))
+    ctx.heTuples[alloca] = ctx.heTuples[v];
+
   // add the alloca to the 'vars' map
   ctx.varScope[id] = {v->getType(), alloca};
 
@@ -606,6 +875,8 @@ llvm::Value *AST::Var::llvmValue(Compiler::Context &ctx) {
 }
 
 llvm::Value *AST::Set::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
   if (ptr->isIdentifier()) {
     auto id = ((Identifier *)ptr)->getVal();
     if (ctx.isFinal(id)) {
@@ -615,7 +886,10 @@ llvm::Value *AST::Set::llvmValue(Compiler::Context &ctx) {
 
       auto llvmVal = cast(ctx, val->llvmValue(ctx), var.first);
 
-      ctx.builder->CreateStore(llvmVal, var.second);
+      auto store = ctx.builder->CreateStore(llvmVal, var.second);
+      if (!llvm::isa<llvm::AllocaInst>(var.second))
+        ctx.addTBAA(store);
+      ctx.heTuples.erase(var.second);
 
       return llvmVal;
     } else if (ctx.isFunction(id)) {
@@ -632,7 +906,7 @@ llvm::Value *AST::Set::llvmValue(Compiler::Context &ctx) {
     auto llvmVal = cast(ctx, val->llvmValue(ctx),
                         llvmPtr->getType()->getPointerElementType());
 
-    ctx.builder->CreateStore(llvmVal, llvmPtr);
+    ctx.addTBAA(ctx.builder->CreateStore(llvmVal, llvmPtr));
 
     return llvmVal;
   }
@@ -643,6 +917,8 @@ llvm::Value *AST::Set::llvmValue(Compiler::Context &ctx) {
 }
 
 llvm::Value *AST::SetPtr::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
   // get pointer to store the value in
   llvm::Value *ptr = this->ptr->llvmValue(ctx);
 
@@ -667,13 +943,15 @@ llvm::Value *AST::SetPtr::llvmValue(Compiler::Context &ctx) {
         Compiler::llvmTypeStr(valT) + U", got: " +
         Compiler::llvmTypeStr(val->getType()) + U")");
 
-  ctx.builder->CreateStore(val1, ptr);
+  ctx.addTBAA(ctx.builder->CreateStore(val1, ptr));
 
   // return stored value
   return val1;
 }
 
 llvm::Value *AST::Ref::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
   // get the current 'needsRef' value
   bool b = ctx.needsRef;
 
@@ -687,6 +965,9 @@ llvm::Value *AST::Ref::llvmValue(Compiler::Context &ctx) {
   if (!v->getType()->isPointerTy())
     Error::compiler(U"failed to create reference");
 
+  // the variable could be changed through the reference
+  ctx.heTuples.erase(v);
+
   // set 'needsRef' flag to the value stored in 'b'
   ctx.needsRef = b;
 
@@ -695,15 +976,151 @@ llvm::Value *AST::Ref::llvmValue(Compiler::Context &ctx) {
 }
 
 llvm::Value *AST::Deref::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
   auto ptr = this->ptr->llvmValue(ctx);
 
   if (!ptr->getType()->isPointerTy())
     Error::compiler(U"expected pointer type for deref expression");
 
-  return ctx.builder->CreateLoad(ptr->getType()->getPointerElementType(), ptr);
+  auto load =
+      ctx.builder->CreateLoad(ptr->getType()->getPointerElementType(), ptr);
+  ctx.addTBAA(load);
+  return load;
+}
+
+llvm::Value *AST::Atomic::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
+  using llvm::AtomicOrdering;
+  auto order =
+      orders.empty() ? AtomicOrdering::SequentiallyConsistent : orders[0];
+  bool acquires = order == AtomicOrdering::Acquire ||
+                  order == AtomicOrdering::AcquireRelease;
+  bool releases = order == AtomicOrdering::Release ||
+                  order == AtomicOrdering::AcquireRelease;
+
+  if (at == ATOMIC_FENCE) {
+    if (order == AtomicOrdering::Monotonic)
+      Error::compiler(U"'fence' expression cannot be relaxed");
+    ctx.builder->CreateFence(order);
+    return constInt(ctx, 0);
+  }
+
+  auto ptr = args[0]->llvmValue(ctx);
+  if (!ptr->getType()->isPointerTy())
+    Error::compiler(U"expected pointer type for atomic expression");
+
+  auto t = ptr->getType()->getPointerElementType();
+  if (!t->isIntegerTy() && !t->isFloatingPointTy() && !t->isPointerTy())
+    Error::compiler(U"atomic expressions need a pointer to an integer, float "
+                    "or pointer, got " +
+                    Compiler::llvmTypeStr(ptr->getType()));
+
+  std::vector<llvm::Value *> vals;
+  for (size_t i = 1; i < args.size(); i++) {
+    auto val = args[i]->llvmValue(ctx);
+    auto val1 = tryCast(ctx, val, t);
+    if (!val1 || val1->getType() != t)
+      Error::compiler(U"invalid value for atomic expression (expected: " +
+                      Compiler::llvmTypeStr(t) + U", got: " +
+                      Compiler::llvmTypeStr(val->getType()) + U")");
+    vals.push_back(val1);
+  }
+
+  // atomic accesses have to be naturally aligned
+  auto align = llvm::Align(ctx.mod->getDataLayout().getTypeStoreSize(t));
+
+  switch (at) {
+  case ATOMIC_LOAD: {
+    if (releases)
+      Error::compiler(U"'atomic-load' expression cannot release");
+    auto load = ctx.builder->CreateLoad(t, ptr);
+    load->setAlignment(align);
+    load->setAtomic(order);
+    return load;
+  }
+  case ATOMIC_STORE: {
+    if (acquires)
+      Error::compiler(U"'atomic-store' expression cannot acquire");
+    auto store = ctx.builder->CreateStore(vals[0], ptr);
+    store->setAlignment(align);
+    store->setAtomic(order);
+    return vals[0];
+  }
+  case ATOMIC_CAS: {
+    if (t->isFloatingPointTy())
+      Error::compiler(U"'cas' expression needs a pointer to an integer or "
+                      "pointer");
+
+    auto failure =
+        orders.size() > 1
+            ? orders[1]
+            : llvm::AtomicCmpXchgInst::getStrongestFailureOrdering(order);
+    if (failure == AtomicOrdering::Release ||
+        failure == AtomicOrdering::AcquireRelease ||
+        llvm::isStrongerThan(failure, order))
+      Error::compiler(U"invalid failure ordering for 'cas' expression");
+
+    // returns the previous value, it was swapped if it is the expected one
+    auto cas = ctx.builder->Insert(
+        new llvm::AtomicCmpXchgInst(ptr, vals[0], vals[1], align, order,
+                                    failure, llvm::SyncScope::System));
+    return ctx.builder->CreateExtractValue(cas, 0);
+  }
+  default:
+    break;
+  }
+
+  llvm::AtomicRMWInst::BinOp op;
+  switch (at) {
+  case ATOMIC_SWAP:
+    op = llvm::AtomicRMWInst::Xchg;
+    break;
+  case ATOMIC_ADD:
+    op = t->isFloatingPointTy() ? llvm::AtomicRMWInst::FAdd
+                                : llvm::AtomicRMWInst::Add;
+    break;
+  case ATOMIC_SUB:
+    op = t->isFloatingPointTy() ? llvm::AtomicRMWInst::FSub
+                                : llvm::AtomicRMWInst::Sub;
+    break;
+  case ATOMIC_AND:
+    op = llvm::AtomicRMWInst::And;
+    break;
+  case ATOMIC_OR:
+    op = llvm::AtomicRMWInst::Or;
+    break;
+  default:
+    op = llvm::AtomicRMWInst::Xor;
+    break;
+  }
+
+  if (t->isPointerTy() && op != llvm::AtomicRMWInst::Xchg)
+    Error::compiler(U"atomic arithmetic on pointers is not supported");
+  if (t->isFloatingPointTy() && op != llvm::AtomicRMWInst::Xchg &&
+      op != llvm::AtomicRMWInst::FAdd && op != llvm::AtomicRMWInst::FSub)
+    Error::compiler(U"atomic bitwise operations need a pointer to an integer");
+
+  // pointers are swapped as integers of the same size
+  auto val = vals[0];
+  if (t->isPointerTy()) {
+    auto intT = ctx.mod->getDataLayout().getIntPtrType(t);
+    ptr = ctx.builder->CreatePointerCast(ptr, intT->getPointerTo());
+    val = ctx.builder->CreatePtrToInt(val, intT);
+  }
+
+  // returns the previous value
+  llvm::Value *old = ctx.builder->Insert(new llvm::AtomicRMWInst(
+      op, ptr, val, align, order, llvm::SyncScope::System));
+  if (t->isPointerTy())
+    old = ctx.builder->CreateIntToPtr(old, t);
+  return old;
 }
 
 llvm::Value *AST::HeGet::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
   auto ptr = this->ptr->llvmValue(ctx);
 
   auto t = ptr->getType();
@@ -717,29 +1134,787 @@ llvm::Value *AST::HeGet::llvmValue(Compiler::Context &ctx) {
     Error::compiler(
         U"expected integer type fot heget expression as third argument");
 
-  t = type->llvmType(ctx)->getPointerTo();
+  t = type->llvmType(ctx);
+
+  // the tuple of an array literal or of a variable it is stored in
+  llvm::Value *key = ptr;
+  if (this->ptr->isIdentifier()) {
+    auto id = ((Identifier *)this->ptr)->getVal();
+    if (ctx.isVar(id))
+      key = ctx.varScope[id].second;
+  }
+  auto it = ctx.heTuples.find(key);
+  auto cidx = llvm::dyn_cast<llvm::ConstantInt>(idx);
+
+  llvm::Value *elem = nullptr;
+  if (it != ctx.heTuples.end() && cidx) {
+    auto tuple = it->second->tuple;
+    auto tupleT = llvm::cast<llvm::StructType>(tuple->getAllocatedType());
+    if (cidx->getZExtValue() >= tupleT->getNumElements())
+      Error::compiler(U"index out of bounds for heget expression");
+
+    elem = ctx.builder->CreateStructGEP(tupleT, tuple, cidx->getZExtValue());
+    elem = ctx.builder->CreatePointerCast(elem, t->getPointerTo());
+  }
 
   ptr = ctx.builder->CreateGEP(ptr, idx);
   ptr = ctx.builder->CreatePointerCast(ptr, t->getPointerTo()->getPointerTo());
-  ptr = ctx.builder->CreateLoad(t->getPointerTo(), ptr);
+  auto load = ctx.builder->CreateLoad(t->getPointerTo(), ptr);
+
+  // elements at constant indices are loaded from the tuple directly, unless
+  // the array is written to later on (i.e. in a loop), which is only known
+  // once the function is generated
+  if (elem)
+    ctx.heLoads.push_back({it->second, load, elem});
+
+  return ctx.builder->CreateLoad(t, load);
+}
+
+// evaluates 'expr' to a pointer to the struct it is or points to, variables
+// and array elements are accessed in place
+static llvm::Value *structRef(Compiler::Context &ctx, AST::Expr *expr,
+                              bool needsRef) {
+  bool b = ctx.needsRef;
+
+  if (expr->isIdentifier()) {
+    auto id = ((AST::Identifier *)expr)->getVal();
+    ctx.needsRef = ctx.isVar(id) || ctx.isFinal(id);
+  } else {
+    ctx.needsRef = expr->isPtrElementCall(ctx);
+  }
+
+  auto v = expr->llvmValue(ctx);
+
+  // the struct pointer is stored in the referenced variable
+  if (ctx.needsRef && v->getType()->isPointerTy() &&
+      v->getType()->getPointerElementType()->isPointerTy())
+    v = ctx.builder->CreateLoad(v->getType()->getPointerElementType(), v);
+
+  ctx.needsRef = b;
+
+  if (v->getType()->isStructTy()) {
+    if (needsRef)
+      Error::compiler(U"cannot reference a field of a temporary struct");
+
+    auto alloca = Compiler::createAlloca(
+        ctx.builder->GetInsertBlock()->getParent(), v->getType(),
+        ctx.getAlign(v->getType()));
+    ctx.builder->CreateStore(v, alloca);
+    v = alloca;
+  }
+
+  auto t = v->getType();
+  if (!(t->isPointerTy() && t->getPointerElementType()->isStructTy()))
+    Error::compiler(U"expected struct or pointer to struct, got " +
+                    Compiler::llvmTypeStr(t));
+
+  return v;
+}
+
+// the soa collection type of 'expr' if it is a variable of (a pointer to) one
+static llvm::StructType *soaType(Compiler::Context &ctx, AST::Expr *expr) {
+  if (!expr->isIdentifier())
+    return nullptr;
+
+  auto id = ((AST::Identifier *)expr)->getVal();
+  llvm::Type *t = ctx.isVar(id)     ? ctx.varScope[id].first
+                  : ctx.isFinal(id) ? ctx.finalScope[id].first
+                                    : nullptr;
+
+  if (t && t->isPointerTy())
+    t = t->getPointerElementType();
+
+  auto st = t ? llvm::dyn_cast<llvm::StructType>(t) : nullptr;
+  return st && ctx.soas.count(st) ? st : nullptr;
+}
+
+static int checkedFieldIndex(Compiler::Context &ctx, llvm::StructType *st,
+                             const std::string &field) {
+  int idx = ctx.fieldIndex(st, field);
+  if (idx < 0)
+    Error::compiler(Compiler::llvmTypeStr(st) + U" has no field '" +
+                    std::stou32(field) + U"'");
+  return idx;
+}
+
+llvm::Value *AST::Get::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
+  // only the field itself is referenced
+  bool needsRef = ctx.needsRef;
+  ctx.needsRef = false;
+
+  llvm::Value *fieldPtr = nullptr;
+  llvm::Type *fieldT = nullptr;
+
+  llvm::StructType *soaT = nullptr;
+  if (ptr->isCall() && ((Call *)ptr)->args.size() == 1)
+    soaT = soaType(ctx, ((Call *)ptr)->callee);
+
+  if (soaT) {
+    // '(get (<soa> <idx>) <field>)' indexes the array of the field
+    auto call = (Call *)ptr;
+    auto soa = structRef(ctx, call->callee, false);
+
+    auto idxT = llvm::Type::getInt64Ty(ctx.mod->getContext());
+    auto idx = tryCast(ctx, call->args[0]->llvmValue(ctx), idxT);
+    if (!idx)
+      Error::compiler(U"index of soa collection must be convertable to an "
+                      U"integer");
+
+    int i = checkedFieldIndex(ctx, soaT, field);
+    auto arrT = soaT->getElementType(i);
+    auto arr = ctx.builder->CreateLoad(
+        arrT, ctx.builder->CreateStructGEP(soaT, soa, i));
+    ctx.addTBAA(arr);
+
+    fieldPtr = ctx.builder->CreateGEP(arr, idx);
+    fieldT = arrT->getPointerElementType();
+  } else {
+    auto v = structRef(ctx, ptr, needsRef);
+    auto st = llvm::cast<llvm::StructType>(v->getType()->getPointerElementType());
+
+    int i = checkedFieldIndex(ctx, st, field);
+    fieldPtr = ctx.builder->CreateStructGEP(st, v, i);
+    fieldT = st->getElementType(i);
+  }
+
+  ctx.needsRef = needsRef;
+  if (needsRef)
+    return fieldPtr;
+
+  auto load = ctx.builder->CreateLoad(fieldT, fieldPtr);
+  ctx.addTBAA(load);
+  return load;
+}
+
+// points the field arrays of 'soa' (if not null) into 'buf', returns the
+// number of bytes used for 'n' elements
+static llvm::Value *soaLayout(Compiler::Context &ctx, llvm::StructType *soaT,
+                              llvm::Value *n, llvm::Value *soa = nullptr,
+                              llvm::Value *buf = nullptr) {
+  auto &dl = ctx.mod->getDataLayout();
+  auto i8T = llvm::Type::getInt8Ty(ctx.mod->getContext());
+
+  // every array starts on its own cache line
+  const uint64_t align = 64;
+
+  llvm::Value *offset = Compiler::constInt(ctx, 0);
+  for (unsigned i = 0; i < soaT->getNumElements(); i++) {
+    auto arrT = soaT->getElementType(i);
+
+    if (soa) {
+      auto arr = ctx.builder->CreateGEP(i8T, buf, offset);
+      ctx.builder->CreateStore(ctx.builder->CreatePointerCast(arr, arrT),
+                               ctx.builder->CreateStructGEP(soaT, soa, i));
+    }
+
+    auto size = dl.getTypeAllocSize(arrT->getPointerElementType());
+    auto bytes = ctx.builder->CreateMul(
+        n, Compiler::constInt(ctx, size.getFixedSize()));
+    offset = ctx.builder->CreateAdd(
+        offset, ctx.builder->CreateAnd(
+                    ctx.builder->CreateAdd(bytes,
+                                           Compiler::constInt(ctx, align - 1)),
+                    Compiler::constInt(ctx, -align)));
+  }
+
+  return offset;
+}
+
+llvm::Value *AST::SoaSize::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
+  auto t = llvm::dyn_cast<llvm::StructType>(type->llvmType(ctx));
+  if (!t || !ctx.soas.count(t))
+    Error::compiler(U"expected soa collection type for 'soa-size' expression");
+
+  auto idxT = llvm::Type::getInt64Ty(ctx.mod->getContext());
+  auto n = tryCast(ctx, this->n->llvmValue(ctx), idxT);
+  if (!n)
+    Error::compiler(U"number of elements must be convertable to an integer");
+
+  return soaLayout(ctx, t, n);
+}
+
+llvm::Value *AST::SoaInit::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
+  auto soaT = soaType(ctx, soa);
+  if (!soaT)
+    Error::compiler(U"expected variable of soa collection type for "
+                    U"'soa-init' expression");
+
+  auto soa = structRef(ctx, this->soa, true);
+
+  auto bufT = llvm::Type::getInt8PtrTy(ctx.mod->getContext());
+  auto buf = tryCast(ctx, this->buf->llvmValue(ctx), bufT);
+  if (!buf || !buf->getType()->isPointerTy())
+    Error::compiler(U"expected pointer as buffer for 'soa-init' expression");
+  buf = ctx.builder->CreatePointerCast(buf, bufT);
+
+  auto idxT = llvm::Type::getInt64Ty(ctx.mod->getContext());
+  auto n = tryCast(ctx, this->n->llvmValue(ctx), idxT);
+  if (!n)
+    Error::compiler(U"number of elements must be convertable to an integer");
 
-  return ctx.builder->CreateLoad(t, ptr);
+  return soaLayout(ctx, soaT, n, soa, buf);
+}
+
+// generates a function 'void(i8* env, i64 lo, i64 hi)' for code of 'expr' run
+// by the runtime (generated by 'gen' into the function, after its entry
+// block). it uses the variables of the current function through pointers to
+// them, 'env' is set to the array of those pointers
+static llvm::Function *
+outline(Compiler::Context &ctx, AST::Expr *expr, const std::string &name,
+        const std::function<void(llvm::Function *)> &gen, llvm::Value *&env) {
+  auto &c = ctx.mod->getContext();
+  auto i64T = llvm::Type::getInt64Ty(c);
+  auto envT = llvm::Type::getInt8PtrTy(c);
+
+  auto bodyT = llvm::FunctionType::get(llvm::Type::getVoidTy(c),
+                                       {envT, i64T, i64T}, false);
+  auto f = llvm::Function::Create(bodyT, llvm::Function::PrivateLinkage,
+                                  ctx.localName(name, expr->line), ctx.mod);
+  f->getArg(0)->setName("env");
+  f->getArg(1)->setName("lo");
+  f->getArg(2)->setName("hi");
+
+  auto prevBB = ctx.builder->GetInsertBlock();
+  auto entryBB = llvm::BasicBlock::Create(c, "", f);
+  auto bodyBB = llvm::BasicBlock::Create(c, "body", f);
+
+  auto prevLoc = ctx.builder->getCurrentDebugLocation();
+  auto prevScope = ctx.beginDebugScope(f, "", expr->line, expr->col);
+
+  // pointers to captured variables are loaded in the entry block
+  ctx.builder->SetInsertPoint(entryBB);
+  ctx.builder->CreateBr(bodyBB);
+
+  // variables of the enclosing function are used in place
+  ctx.closures.push_back({f, ctx.varScope, {}, true});
+  auto prevTuples = ctx.heTuples;
+  auto prevFrame = ctx.syncFrame;
+  auto prevCoroutine = ctx.coroutine;
+  ctx.varScope.clear();
+  ctx.syncFrame = nullptr;
+  ctx.coroutine = nullptr;
+
+  ctx.builder->SetInsertPoint(bodyBB);
+  gen(f);
+  ctx.syncSpawns();
+  ctx.builder->CreateRetVoid();
+
+  ctx.endDebugScope(prevScope);
+  ctx.builder->SetInsertPoint(prevBB);
+  ctx.builder->SetCurrentDebugLocation(prevLoc);
+
+  auto closure = ctx.closures.back();
+  ctx.closures.pop_back();
+  ctx.varScope = closure.outer;
+  ctx.heTuples = prevTuples;
+  ctx.syncFrame = prevFrame;
+  ctx.coroutine = prevCoroutine;
+
+  env = llvm::Constant::getNullValue(envT);
+  if (!closure.captures.empty()) {
+    auto ptrsT = llvm::ArrayType::get(envT, closure.captures.size());
+    auto ptrs = Compiler::createAlloca(prevBB->getParent(), ptrsT);
+    for (size_t i = 0; i < closure.captures.size(); i++) {
+      auto var = closure.captures[i].first.second;
+      ctx.builder->CreateStore(ctx.builder->CreatePointerCast(var, envT),
+                               ctx.builder->CreateConstGEP2_64(ptrsT, ptrs, 0, i));
+    }
+    env = ctx.builder->CreatePointerCast(ptrs, envT);
+  }
+
+  ctx.placeClosureEnvs(f);
+  ctx.forwardHeLoads(f);
+
+  if (llvm::verifyFunction(*f)) {
+    // f->print(llvm::errs());
+    Error::compiler(U"error in " + std::stou32(name) + U" expression");
+  }
+
+  // lambdas called in it (i.e. by 'pmap') are inlined
+  ctx.inlineLocalCalls(f);
+  ctx.runFPM(f);
+
+  return f;
+}
+
+llvm::Value *AST::ParallelFor::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
+  auto &c = ctx.mod->getContext();
+  auto i64T = llvm::Type::getInt64Ty(c);
+
+  for (auto &var : vars) {
+    auto v = var.second->llvmValue(ctx);
+    auto alloca = Compiler::createAlloca(
+        ctx.builder->GetInsertBlock()->getParent(), v->getType(),
+        ctx.getAlign(v->getType()));
+    ctx.builder->CreateStore(v, alloca);
+    ctx.varScope[var.first] = {v->getType(), alloca};
+  }
+
+  auto startV = tryCast(ctx, start->llvmValue(ctx), i64T);
+  auto endV = tryCast(ctx, end->llvmValue(ctx), i64T);
+  if (!startV || !endV)
+    Error::compiler(U"range of 'parallel-for' expression must be "
+                    "convertable to integers");
+
+  // the body runs for the chunks [lo, hi) of the range the runtime hands out
+  llvm::Value *env;
+  auto f = outline(ctx, this, "parallel-for", [&](llvm::Function *f) {
+    auto condBB = llvm::BasicBlock::Create(c, "cond", f);
+    auto loopBB = llvm::BasicBlock::Create(c, "loop", f);
+    auto exitBB = llvm::BasicBlock::Create(c, "exit", f);
+
+    auto idx = Compiler::createAlloca(f, i64T);
+    ctx.builder->CreateStore(f->getArg(1), idx);
+    ctx.builder->CreateBr(condBB);
+
+    ctx.builder->SetInsertPoint(condBB);
+    auto cond = ctx.builder->CreateICmpSLT(ctx.builder->CreateLoad(i64T, idx),
+                                           f->getArg(2));
+    ctx.builder->CreateCondBr(cond, loopBB, exitBB);
+
+    ctx.varScope[id] = {i64T, idx};
+
+    ctx.builder->SetInsertPoint(loopBB);
+    for (auto &expr : body)
+      expr->llvmValue(ctx);
+
+    auto next = ctx.builder->CreateAdd(ctx.builder->CreateLoad(i64T, idx),
+                                       constInt(ctx, 1));
+    ctx.builder->CreateStore(next, idx);
+    ctx.builder->CreateBr(condBB);
+
+    ctx.builder->SetInsertPoint(exitBB);
+  }, env);
+
+  auto parallelFor = ctx.mod->getOrInsertFunction(
+      "adscript_parallel_for", llvm::Type::getVoidTy(c),
+      f->getType(), env->getType(), i64T, i64T);
+  ctx.builder->CreateCall(parallelFor, {f, env, startV, endV});
+
+  for (auto &var : vars)
+    ctx.varScope.erase(var.first);
+
+  return constInt(ctx, 0);
+}
+
+llvm::Value *AST::Spawn::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
+  llvm::Value *env;
+  auto f = outline(ctx, this, "spawn", [&](llvm::Function *) {
+    expr->llvmValue(ctx);
+  }, env);
+
+  auto frame = ctx.getSyncFrame();
+  auto spawn = ctx.mod->getOrInsertFunction(
+      "adscript_spawn", llvm::Type::getVoidTy(ctx.mod->getContext()),
+      f->getType(), env->getType(), frame->getType());
+  ctx.builder->CreateCall(spawn, {f, env, frame});
+
+  return constInt(ctx, 0);
+}
+
+llvm::Value *AST::Sync::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+  ctx.syncSpawns();
+  return constInt(ctx, 0);
+}
+
+llvm::Value *AST::While::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
+  auto f = ctx.builder->GetInsertBlock()->getParent();
+
+  auto condBB = llvm::BasicBlock::Create(ctx.mod->getContext(), "cond", f);
+  auto loopBB = llvm::BasicBlock::Create(ctx.mod->getContext(), "loop", f);
+  auto exitBB = llvm::BasicBlock::Create(ctx.mod->getContext(), "exit", f);
+
+  ctx.builder->CreateBr(condBB);
+
+  ctx.builder->SetInsertPoint(condBB);
+  ctx.builder->CreateCondBr(createLogicalVal(ctx, cond->llvmValue(ctx)), loopBB,
+                            exitBB);
+
+  ctx.builder->SetInsertPoint(loopBB);
+  for (auto &expr : body)
+    expr->llvmValue(ctx);
+  ctx.builder->CreateBr(condBB);
+
+  ctx.builder->SetInsertPoint(exitBB);
+  return constInt(ctx, 0);
+}
+
+llvm::Value *AST::Yield::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
+  if (!ctx.coroutine)
+    Error::compiler(U"'yield' expression outside of async function");
+
+  if (val) {
+    auto promise = ctx.coroutine->promise;
+    ctx.builder->CreateStore(
+        cast(ctx, val->llvmValue(ctx), promise->getAllocatedType()), promise);
+  }
+
+  ctx.suspend();
+  return constInt(ctx, 0);
+}
+
+// the coroutine handle 'expr' evaluates to, as i8*, and the type it yields
+static llvm::Value *coroHandle(Compiler::Context &ctx, AST::Expr *expr,
+                               llvm::Type *&valueT) {
+  auto h = expr->llvmValue(ctx);
+
+  valueT = ctx.asyncValueType(h->getType());
+  if (!valueT)
+    Error::compiler(U"expected handle of async function, got " +
+                    Compiler::llvmTypeStr(h->getType()));
+
+  return ctx.builder->CreatePointerCast(
+      h, llvm::Type::getInt8PtrTy(ctx.mod->getContext()));
+}
+
+static llvm::Value *coroPromise(Compiler::Context &ctx, llvm::Value *hdl,
+                                llvm::Type *valueT) {
+  auto promiseF =
+      llvm::Intrinsic::getDeclaration(ctx.mod, llvm::Intrinsic::coro_promise);
+  auto p = ctx.builder->CreateCall(
+      promiseF, {hdl, ctx.builder->getInt32(ctx.getAlign(valueT)),
+                 ctx.builder->getFalse()});
+  return ctx.builder->CreateLoad(
+      valueT, ctx.builder->CreatePointerCast(p, valueT->getPointerTo()));
+}
+
+llvm::Value *AST::Await::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
+  llvm::Type *valueT;
+  auto hdl = coroHandle(ctx, handle, valueT);
+
+  auto &c = ctx.mod->getContext();
+  auto f = ctx.builder->GetInsertBlock()->getParent();
+  auto doneF = llvm::Intrinsic::getDeclaration(ctx.mod, llvm::Intrinsic::coro_done);
+  auto resumeF =
+      llvm::Intrinsic::getDeclaration(ctx.mod, llvm::Intrinsic::coro_resume);
+  auto destroyF =
+      llvm::Intrinsic::getDeclaration(ctx.mod, llvm::Intrinsic::coro_destroy);
+
+  auto stepBB = llvm::BasicBlock::Create(c, "step", f);
+  auto resumeBB = llvm::BasicBlock::Create(c, "resume", f);
+  auto doneBB = llvm::BasicBlock::Create(c, "done", f);
+
+  ctx.builder->CreateBr(stepBB);
+
+  ctx.builder->SetInsertPoint(stepBB);
+  ctx.builder->CreateCondBr(ctx.builder->CreateCall(doneF, hdl), doneBB,
+                            resumeBB);
+
+  // a coroutine awaiting another one suspends whenever that one does
+  ctx.builder->SetInsertPoint(resumeBB);
+  ctx.builder->CreateCall(resumeF, hdl);
+  if (ctx.coroutine) {
+    auto waitBB = llvm::BasicBlock::Create(c, "wait", f);
+    ctx.builder->CreateCondBr(ctx.builder->CreateCall(doneF, hdl), doneBB,
+                              waitBB);
+    ctx.builder->SetInsertPoint(waitBB);
+    ctx.suspend();
+  }
+  ctx.builder->CreateBr(stepBB);
+
+  ctx.builder->SetInsertPoint(doneBB);
+  auto result = coroPromise(ctx, hdl, valueT);
+  ctx.builder->CreateCall(destroyF, hdl);
+
+  return result;
+}
+
+llvm::Value *AST::Coro::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
+  llvm::Type *valueT;
+  auto hdl = coroHandle(ctx, handle, valueT);
+
+  switch (ct) {
+  case CORO_PROMISE:
+    return coroPromise(ctx, hdl, valueT);
+  case CORO_DESTROY:
+    ctx.builder->CreateCall(
+        llvm::Intrinsic::getDeclaration(ctx.mod, llvm::Intrinsic::coro_destroy),
+        hdl);
+    return constInt(ctx, 0);
+  case CORO_RESUME:
+    break;
+  }
+
+  // finished coroutines must not be resumed, returns whether it is not done
+  auto &c = ctx.mod->getContext();
+  auto f = ctx.builder->GetInsertBlock()->getParent();
+  auto doneF = llvm::Intrinsic::getDeclaration(ctx.mod, llvm::Intrinsic::coro_done);
+
+  auto resumeBB = llvm::BasicBlock::Create(c, "resume", f);
+  auto mergeBB = llvm::BasicBlock::Create(c, "", f);
+
+  auto done = ctx.builder->CreateCall(doneF, hdl);
+  auto prevBB = ctx.builder->GetInsertBlock();
+  ctx.builder->CreateCondBr(done, mergeBB, resumeBB);
+
+  ctx.builder->SetInsertPoint(resumeBB);
+  ctx.builder->CreateCall(
+      llvm::Intrinsic::getDeclaration(ctx.mod, llvm::Intrinsic::coro_resume),
+      hdl);
+  auto doneNow = ctx.builder->CreateCall(doneF, hdl);
+  ctx.builder->CreateBr(mergeBB);
+
+  ctx.builder->SetInsertPoint(mergeBB);
+  auto phi = ctx.builder->CreatePHI(done->getType(), 2);
+  phi->addIncoming(done, prevBB);
+  phi->addIncoming(doneNow, resumeBB);
+
+  return ctx.builder->CreateZExt(ctx.builder->CreateNot(phi),
+                                 llvm::Type::getInt64Ty(c));
+}
+
+llvm::Value *AST::TypeInfo::llvmValue(Compiler::Context &ctx) {
+  auto t = type->llvmType(ctx);
+  auto &dl = ctx.mod->getDataLayout();
+
+  if (!t->isSized())
+    Error::compiler(Compiler::llvmTypeStr(t) + U" has no size");
+
+  switch (tit) {
+  case TYPEINFO_SIZEOF:
+    return constInt(ctx, dl.getTypeAllocSize(t).getFixedSize());
+  case TYPEINFO_ALIGNOF:
+    return constInt(ctx, ctx.getAlign(t));
+  case TYPEINFO_OFFSETOF:
+    break;
+  }
+
+  auto st = llvm::dyn_cast<llvm::StructType>(t);
+  if (!st)
+    Error::compiler(U"expected struct type for 'offsetof' expression, got " +
+                    Compiler::llvmTypeStr(t));
+
+  int idx = checkedFieldIndex(ctx, st, field);
+  return constInt(ctx, dl.getStructLayout(st)->getElementOffset(idx));
 }
 
 llvm::Value *AST::Cast::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
   return cast(ctx, expr->llvmValue(ctx), type->llvmType(ctx));
 }
 
+// starts coroutine 'f': allocates its frame (unless the caller provides it)
+// and creates the blocks destroying it and returning to the caller
+static void beginCoroutine(Compiler::Context &ctx, llvm::Function *f,
+                           Compiler::Context::Coroutine &coro) {
+  auto &c = ctx.mod->getContext();
+  auto i8PtrT = llvm::Type::getInt8PtrTy(c);
+  auto i64T = llvm::Type::getInt64Ty(c);
+  auto intrinsic = [&](llvm::Intrinsic::ID id,
+                       llvm::ArrayRef<llvm::Type *> tys = {}) {
+    return llvm::Intrinsic::getDeclaration(ctx.mod, id, tys);
+  };
+
+  // the frontend marks coroutines to be split
+  f->addFnAttr("coroutine.presplit", "0");
+
+  // yielded values and the result are stored in the promise
+  auto valueT = ctx.asyncValueType(f->getReturnType());
+  unsigned align = ctx.getAlign(valueT);
+  coro.promise = Compiler::createAlloca(f, valueT);
+  coro.promise->setAlignment(llvm::Align(align));
+
+  auto null = llvm::Constant::getNullValue(i8PtrT);
+  coro.id = ctx.builder->CreateCall(
+      intrinsic(llvm::Intrinsic::coro_id),
+      {ctx.builder->getInt32(align),
+       ctx.builder->CreatePointerCast(coro.promise, i8PtrT), null, null});
+
+  auto entryBB = ctx.builder->GetInsertBlock();
+  auto allocBB = llvm::BasicBlock::Create(c, "alloc", f);
+  auto beginBB = llvm::BasicBlock::Create(c, "begin", f);
+  ctx.builder->CreateCondBr(
+      ctx.builder->CreateCall(intrinsic(llvm::Intrinsic::coro_alloc), coro.id),
+      allocBB, beginBB);
+
+  auto malloc = ctx.mod->getOrInsertFunction("malloc", i8PtrT, i64T);
+  auto free = ctx.mod->getOrInsertFunction(
+      "free", llvm::Type::getVoidTy(c), i8PtrT);
+
+  ctx.builder->SetInsertPoint(allocBB);
+  auto mem = ctx.builder->CreateCall(
+      malloc, ctx.builder->CreateCall(intrinsic(llvm::Intrinsic::coro_size, i64T)));
+  coro.alloc = mem;
+  ctx.builder->CreateBr(beginBB);
+
+  ctx.builder->SetInsertPoint(beginBB);
+  auto frame = ctx.builder->CreatePHI(i8PtrT, 2);
+  frame->addIncoming(null, entryBB);
+  frame->addIncoming(mem, allocBB);
+  coro.handle = ctx.builder->CreateCall(intrinsic(llvm::Intrinsic::coro_begin),
+                                        {coro.id, frame});
+
+  coro.cleanup = llvm::BasicBlock::Create(c, "cleanup", f);
+  coro.suspend = llvm::BasicBlock::Create(c, "suspend", f);
+  auto freeBB = llvm::BasicBlock::Create(c, "free", f);
+
+  // the frame is only freed if it was allocated
+  llvm::IRBuilder<> b(coro.cleanup);
+  auto toFree = b.CreateCall(intrinsic(llvm::Intrinsic::coro_free),
+                             {coro.id, coro.handle});
+  b.CreateCondBr(b.CreateIsNull(toFree), coro.suspend, freeBB);
+
+  b.SetInsertPoint(freeBB);
+  b.CreateCall(free, toFree);
+  b.CreateBr(coro.suspend);
+
+  b.SetInsertPoint(coro.suspend);
+  b.CreateCall(intrinsic(llvm::Intrinsic::coro_end),
+               {coro.handle, b.getFalse()});
+  b.CreateRet(b.CreatePointerCast(coro.handle, f->getReturnType()));
+}
+
+// allocates the frame of coroutine 'f' aligned to its most aligned variable
+// if malloc does not guarantee that alignment (i.e. for aligned structs)
+static void alignFrame(Compiler::Context &ctx, llvm::Function *f,
+                       Compiler::Context::Coroutine &coro) {
+  uint64_t align = 16;
+  for (auto &bb : *f)
+    for (auto &inst : bb)
+      if (auto alloca = llvm::dyn_cast<llvm::AllocaInst>(&inst))
+        align = std::max(align, alloca->getAlign().value());
+  if (align <= 16)
+    return;
+
+  auto i8PtrT = llvm::Type::getInt8PtrTy(ctx.mod->getContext());
+  auto i64T = llvm::Type::getInt64Ty(ctx.mod->getContext());
+  auto alignedAlloc =
+      ctx.mod->getOrInsertFunction("aligned_alloc", i8PtrT, i64T, i64T);
+
+  // the size has to be a multiple of the alignment
+  llvm::IRBuilder<> b(coro.alloc);
+  auto size = b.CreateAnd(b.CreateAdd(coro.alloc->getArgOperand(0),
+                                      b.getInt64(align - 1)),
+                          b.getInt64(-align));
+  auto mem = b.CreateCall(alignedAlloc, {b.getInt64(align), size});
+  coro.alloc->replaceAllUsesWith(mem);
+  coro.alloc->eraseFromParent();
+  coro.alloc = mem;
+}
+
 llvm::Value *AST::Function::llvmValue(Compiler::Context &ctx) {
+  // generic functions are generated when they are called
+  if (!typeParams.empty()) {
+    if (body.empty())
+      Error::compiler(U"generic function '" + std::stou32(id) +
+                      U"' must have a body");
+    ctx.addGeneric(id, this, src);
+    return constInt(ctx, 0);
+  }
+
+  return define(ctx, id, true);
+}
+
+llvm::Function *
+AST::Function::instantiate(Compiler::Context &ctx,
+                           const std::vector<llvm::Value *> &argVals) {
+  if (argVals.size() > args.size())
+    Error::compiler(U"too many arguments for function '" + std::stou32(id) +
+                    U"'");
+  else if (argVals.size() < args.size())
+    Error::compiler(U"too few arguments for function '" + std::stou32(id) +
+                    U"'");
+
+  // the first argument of a type parameter determines it
+  std::map<std::string, llvm::Type *> params;
+  for (auto &param : typeParams)
+    params[param] = nullptr;
+  for (size_t i = 0; i < args.size(); i++)
+    args[i].second->bind(argVals[i]->getType(), params);
+
+  // named after the types, i.e. 'add<i64>'
+  std::u32string name = std::stou32(id) + U"<";
+  for (size_t i = 0; i < typeParams.size(); i++) {
+    auto t = params[typeParams[i]];
+    if (!t)
+      Error::compiler(U"cannot infer type parameter '" +
+                      std::stou32(typeParams[i]) + U"' of function '" +
+                      std::stou32(id) + U"'");
+    name += (i ? U"," : U"") + Compiler::llvmTypeStr(t);
+  }
+  name += U">";
+
+  // recursive calls use the instance that is generated at the moment
+  if (auto f = ctx.mod->getFunction(std::to_string(name)))
+    return f;
+
+  // the instance is generated in the middle of its caller
+  auto ip = ctx.builder->saveIP();
+  auto loc = ctx.builder->getCurrentDebugLocation();
+  auto varScope = ctx.varScope;
+  auto heTuples = ctx.heTuples;
+  auto syncFrame = ctx.syncFrame;
+  auto coroutine = ctx.coroutine;
+  auto needsRef = ctx.needsRef;
+  std::vector<Compiler::Context::Closure> closures;
+  closures.swap(ctx.closures);
+  ctx.varScope.clear();
+  ctx.heTuples.clear();
+  ctx.needsRef = false;
+
+  // the type parameters name the types of this instance
+  std::map<std::string, llvm::Type *> prevTypes;
+  for (auto &param : params) {
+    if (ctx.isType(param.first))
+      prevTypes[param.first] = ctx.types[param.first];
+    ctx.types[param.first] = param.second;
+  }
+
+  auto f = define(ctx, std::to_string(name), false);
+  // like c++ templates, every module using an instance has its own copy
+  f->setLinkage(llvm::Function::LinkOnceODRLinkage);
+
+  for (auto &param : params) {
+    if (prevTypes.count(param.first))
+      ctx.types[param.first] = prevTypes[param.first];
+    else
+      ctx.types.erase(param.first);
+  }
+
+  ctx.builder->restoreIP(ip);
+  ctx.builder->SetCurrentDebugLocation(loc);
+  ctx.varScope = varScope;
+  ctx.heTuples = heTuples;
+  ctx.syncFrame = syncFrame;
+  ctx.coroutine = coroutine;
+  ctx.needsRef = needsRef;
+  ctx.closures.swap(closures);
+
+  return f;
+}
+
+llvm::Function *AST::Function::define(Compiler::Context &ctx,
+                                      const std::string &name, bool cache) {
+  Trace::Scope scope("defn", name);
+
   std::vector<llvm::Type *> ftArgs;
   for (auto &arg : args)
     ftArgs.push_back(arg.second->llvmType(ctx));
 
-  auto f = ctx.mod->getFunction(id);
+  auto f = ctx.mod->getFunction(name);
 
   if (f) {
     if (ftArgs.size() != f->arg_size())
-      Error::compiler(U"invalid redefenition of function '" + std::stou32(id) +
+      Error::compiler(U"invalid redefenition of function '" + std::stou32(name) +
                       U"'");
 
     for (size_t i = 0; i < ftArgs.size(); i++) {
@@ -747,16 +1922,31 @@ llvm::Value *AST::Function::llvmValue(Compiler::Context &ctx) {
                f->getArg(i)->getType()->getPointerTo();
       if (b)
         Error::compiler(U"invalid redefenition of function '" +
-                        std::stou32(id) + U"'");
+                        std::stou32(name) + U"'");
     }
 
   } else {
-    auto ft = llvm::FunctionType::get(retType->llvmType(ctx), ftArgs, varArg);
+    // coroutines return their handle
+    auto retT = retType->llvmType(ctx);
+    if (attrs & FN_ASYNC)
+      retT = ctx.getAsyncType(retT);
 
-    f = llvm::Function::Create(ft, llvm::Function::ExternalLinkage, id,
+    auto ft = llvm::FunctionType::get(retT, ftArgs, varArg);
+
+    f = llvm::Function::Create(ft, llvm::Function::ExternalLinkage, name,
                                ctx.mod);
   }
 
+  Compiler::addFnAttrs(f, attrs);
+  for (size_t i = 0; i < args.size(); i++) {
+    if (args[i].second->isRestrict())
+      f->addParamAttr(i, llvm::Attribute::NoAlias);
+  }
+  // the bodies of inline functions are part of their callers, so are the
+  // ramps of async functions (see splitCoroutine)
+  ctx.addSignature(name, f->getFunctionType(), attrs,
+                   attrs & (FN_INLINE | FN_ASYNC) ? std::to_string(src) : "");
+
   if (body.size() <= 0) {
     size_t i = 0;
     for (auto &arg : f->args())
@@ -764,9 +1954,27 @@ llvm::Value *AST::Function::llvmValue(Compiler::Context &ctx) {
     return f;
   }
 
+  // reuse the optimized body of an unchanged function from the cache
+  // (coroutines are split into several functions, so they are not cached)
+  bool async = attrs & FN_ASYNC;
+  std::string key = cache && f->empty() && !async ? ctx.cacheKey(src) : "";
+  if (auto cached = ctx.loadCached(f, key))
+    return cached;
+  size_t specialized = ctx.specialized;
+
   ctx.builder->SetInsertPoint(
       llvm::BasicBlock::Create(ctx.mod->getContext(), "", f));
 
+  auto prevScope = ctx.beginDebugScope(f, file, line, col);
+  ctx.syncFrame = nullptr;
+
+  Compiler::Context::Coroutine coro;
+  ctx.coroutine = nullptr;
+  if (async) {
+    beginCoroutine(ctx, f, coro);
+    ctx.coroutine = &coro;
+  }
+
   size_t i = 0;
   for (auto &arg : f->args()) {
     if (args[i].first.size() <= 0)
@@ -775,34 +1983,132 @@ llvm::Value *AST::Function::llvmValue(Compiler::Context &ctx) {
 
     arg.setName(args[i].first);
 
-    auto alloca = Compiler::createAlloca(f, ftArgs[i]);
+    auto alloca = Compiler::createAlloca(f, ftArgs[i], ctx.getAlign(ftArgs[i]));
 
     ctx.builder->CreateStore(&arg, alloca);
 
     ctx.varScope[args[i++].first] = {arg.getType(), alloca};
   }
 
+  // coroutines start when they are resumed the first time
+  if (async)
+    ctx.suspend();
+
   for (size_t i = 0; i < body.size() - 1; i++)
     body[i]->llvmValue(ctx);
 
   auto retVal = body[body.size() - 1]->llvmValue(ctx);
-  ctx.builder->CreateRet(cast(ctx, retVal, f->getReturnType()));
+  ctx.syncSpawns();
+
+  if (async) {
+    // the result is the last promise
+    ctx.builder->CreateStore(
+        cast(ctx, retVal, coro.promise->getAllocatedType()), coro.promise);
+    ctx.suspend(true);
+  } else {
+    ctx.builder->CreateRet(cast(ctx, retVal, f->getReturnType()));
+  }
+
+  ctx.endDebugScope(prevScope);
 
   ctx.varScope.clear();
+  ctx.heTuples.clear();
+  ctx.syncFrame = nullptr;
+  ctx.coroutine = nullptr;
+  ctx.placeClosureEnvs(f);
+  ctx.forwardHeLoads(f);
 
   if (llvm::verifyFunction(*f)) {
     // f->print(llvm::errs());
-    Error::compiler(U"error in function '" + std::stou32(id) + U"'");
+    Error::compiler(U"error in function '" + std::stou32(name) + U"'");
   }
 
-  ctx.runFPM(f);
+  if (async) {
+    alignFrame(ctx, f, coro);
+    ctx.splitCoroutine(f);
+  } else
+    ctx.runFPM(f);
+  // specializations copy the code of other functions
+  if (ctx.specialized == specialized)
+    ctx.storeCached(f, key);
 
   return f;
 }
 
+// turns lambda 'f' into a function taking the environment of the variables it
+// captured as its first argument and creates that environment on the stack of
+// the current function
+static llvm::Value *createClosure(Compiler::Context &ctx, llvm::Function *&f,
+                                  const Compiler::Context::Closure &c) {
+  auto envT = llvm::Type::getInt8PtrTy(ctx.mod->getContext());
+
+  std::vector<llvm::Type *> captureTypes;
+  for (auto &capture : c.captures)
+    captureTypes.push_back(capture.first.first);
+  auto captureT = llvm::StructType::get(ctx.mod->getContext(), captureTypes);
+
+  auto ft = f->getFunctionType();
+  std::vector<llvm::Type *> ftArgs = {envT};
+  ftArgs.insert(ftArgs.end(), ft->param_begin(), ft->param_end());
+
+  auto closureF = llvm::Function::Create(
+      llvm::FunctionType::get(ft->getReturnType(), ftArgs, ft->isVarArg()),
+      llvm::Function::PrivateLinkage, "", ctx.mod);
+  closureF->takeName(f);
+  closureF->getArg(0)->setName("env");
+
+  closureF->getBasicBlockList().splice(closureF->begin(),
+                                       f->getBasicBlockList());
+  for (auto &arg : f->args()) {
+    auto closureArg = closureF->getArg(arg.getArgNo() + 1);
+    closureArg->takeName(&arg);
+    arg.replaceAllUsesWith(closureArg);
+  }
+  closureF->setSubprogram(f->getSubprogram());
+  f->eraseFromParent();
+  f = closureF;
+
+  // initialize the copies of the captured variables after the allocas
+  auto &entry = f->getEntryBlock();
+  auto it = entry.begin();
+  while (llvm::isa<llvm::AllocaInst>(*it))
+    it++;
+
+  llvm::IRBuilder<> builder(&entry, it);
+  auto env = builder.CreatePointerCast(f->getArg(0), captureT->getPointerTo());
+  for (size_t i = 0; i < c.captures.size(); i++) {
+    auto &capture = c.captures[i];
+    auto field = builder.CreateStructGEP(captureT, env, i);
+    builder.CreateStore(builder.CreateLoad(capture.first.first, field),
+                        capture.second);
+  }
+
+  // fill the environment in the current function
+  auto stackEnv = Compiler::createAlloca(
+      ctx.builder->GetInsertBlock()->getParent(), captureT);
+  auto envPtr = ctx.builder->CreatePointerCast(stackEnv, envT);
+  ctx.closureEnvs.push_back(
+      {stackEnv, llvm::cast<llvm::Instruction>(envPtr)});
+
+  for (size_t i = 0; i < c.captures.size(); i++) {
+    auto &var = c.captures[i].first;
+    ctx.builder->CreateStore(ctx.builder->CreateLoad(var.first, var.second),
+                             ctx.builder->CreateStructGEP(captureT, stackEnv, i));
+  }
+
+  llvm::Value *closure = llvm::UndefValue::get(
+      llvm::StructType::get(f->getType(), envT));
+  closure = ctx.builder->CreateInsertValue(closure, f, 0);
+  return ctx.builder->CreateInsertValue(closure, envPtr, 1);
+}
+
 llvm::Value *AST::Lambda::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
   if (body.size() <= 0)
     Error::compiler(U"lambda expressions cannot have an empty body");
+  if (attrs & FN_ASYNC)
+    Error::compiler(U"lambda expressions cannot be async");
 
   std::vector<llvm::Type *> ftArgs;
   for (auto &arg : args)
@@ -810,16 +2116,27 @@ llvm::Value *AST::Lambda::llvmValue(Compiler::Context &ctx) {
 
   auto ft = llvm::FunctionType::get(retType->llvmType(ctx), ftArgs, varArg);
 
-  auto f =
-      llvm::Function::Create(ft, llvm::Function::PrivateLinkage, "", ctx.mod);
+  // named after the function and the line it is in, so profiles can tell
+  // lambdas apart
+  auto f = llvm::Function::Create(ft, llvm::Function::PrivateLinkage,
+                                  ctx.localName("lambda", line), ctx.mod);
 
   auto prevBB = ctx.builder->GetInsertBlock();
   auto fnBB = llvm::BasicBlock::Create(ctx.mod->getContext(), "", f);
 
   ctx.builder->SetInsertPoint(fnBB);
 
-  auto prevVars = ctx.varScope;
+  auto prevLoc = ctx.builder->getCurrentDebugLocation();
+  auto prevScope = ctx.beginDebugScope(f, "", line, col);
+
+  // variables of the enclosing function are captured when they are used
+  ctx.closures.push_back({f, ctx.varScope, {}});
+  auto prevTuples = ctx.heTuples;
+  auto prevFrame = ctx.syncFrame;
+  auto prevCoroutine = ctx.coroutine;
   ctx.varScope.clear();
+  ctx.syncFrame = nullptr;
+  ctx.coroutine = nullptr;
 
   size_t i = 0;
   for (auto &arg : f->args()) {
@@ -828,7 +2145,7 @@ llvm::Value *AST::Lambda::llvmValue(Compiler::Context &ctx) {
 
     arg.setName(args[i].first);
 
-    auto alloca = Compiler::createAlloca(f, ftArgs[i]);
+    auto alloca = Compiler::createAlloca(f, ftArgs[i], ctx.getAlign(ftArgs[i]));
 
     ctx.builder->CreateStore(&arg, alloca);
 
@@ -839,11 +2156,34 @@ llvm::Value *AST::Lambda::llvmValue(Compiler::Context &ctx) {
     body[i]->llvmValue(ctx);
 
   auto retVal = body[body.size() - 1]->llvmValue(ctx);
+  ctx.syncSpawns();
   ctx.builder->CreateRet(cast(ctx, retVal, f->getReturnType()));
 
+  ctx.endDebugScope(prevScope);
   ctx.builder->SetInsertPoint(prevBB);
+  ctx.builder->SetCurrentDebugLocation(prevLoc);
+
+  auto closure = ctx.closures.back();
+  ctx.closures.pop_back();
+  ctx.varScope = closure.outer;
+  ctx.heTuples = prevTuples;
+  ctx.syncFrame = prevFrame;
+  ctx.coroutine = prevCoroutine;
+
+  // lambdas that do not capture anything stay plain functions
+  llvm::Value *v = f;
+  if (!closure.captures.empty())
+    v = createClosure(ctx, f, closure);
+
+  unsigned envArgs = closure.captures.empty() ? 0 : 1;
+  Compiler::addFnAttrs(f, attrs);
+  for (size_t i = 0; i < args.size(); i++) {
+    if (args[i].second->isRestrict())
+      f->addParamAttr(i + envArgs, llvm::Attribute::NoAlias);
+  }
 
-  ctx.varScope = prevVars;
+  ctx.placeClosureEnvs(f);
+  ctx.forwardHeLoads(f);
 
   if (llvm::verifyFunction(*f)) {
     // f->print(llvm::errs());
@@ -852,28 +2192,31 @@ llvm::Value *AST::Lambda::llvmValue(Compiler::Context &ctx) {
 
   ctx.runFPM(f);
 
-  return f;
+  return v;
 }
 
 llvm::Value *AST::Call::llvmValue(Compiler::Context &ctx) {
+  Compiler::LocScope loc(ctx, this);
+
   Identifier *id = nullptr;
   if (callee->isIdentifier())
     id = (Identifier *)callee;
 
-  llvm::Function *f = nullptr;
+  auto name = id ? std::stou32(id->getVal()) : U"lambda";
+
+  llvm::Value *f = nullptr;
 
   if (callee->isLambda()) {
-    f = (llvm::Function *)callee->llvmValue(ctx);
-  } else if (!id && ctx.isFunction(id->getVal())) {
-    f = (llvm::Function *)ctx.mod->getFunction(id->getVal());
+    f = callee->llvmValue(ctx);
   } else if (!id || ctx.isVar(id->getVal()) || ctx.isFinal(id->getVal())) {
     bool needsRef = ctx.needsRef;
     ctx.needsRef = false;
 
     auto ptr = callee->llvmValue(ctx);
 
-    if (Compiler::isFunctionTy(ptr->getType()))
-      f = (llvm::Function *)ptr;
+    if (Compiler::isFunctionTy(ptr->getType()) ||
+        Compiler::isClosureTy(ptr->getType()))
+      f = ptr;
     else if (!ptr->getType()->isPointerTy())
       Error::compiler(Compiler::llvmTypeStr(ptr->getType()) +
                       U" is not a callable type");
@@ -891,51 +2234,76 @@ llvm::Value *AST::Call::llvmValue(Compiler::Context &ctx) {
 
       if (needsRef)
         return v;
-      return ctx.builder->CreateLoad(v->getType()->getPointerElementType(), v);
+      auto load =
+          ctx.builder->CreateLoad(v->getType()->getPointerElementType(), v);
+      ctx.addTBAA(load);
+      return load;
     }
   }
+
+  // generic functions are instantiated for the types of the arguments
+  std::vector<llvm::Value *> argVals;
+  if (!f && ctx.generics.count(id->getVal())) {
+    for (auto &arg : args)
+      argVals.push_back(arg->llvmValue(ctx));
+    f = ctx.generics[id->getVal()]->instantiate(ctx, argVals);
+  }
+
   if (!f)
     f = ctx.mod->getFunction(id->getVal());
 
   if (!f)
-    Error::compiler(U"undefined reference to '" + std::stou32(id->getVal()) +
-                    U"'");
+    Error::compiler(U"undefined reference to '" + name + U"'");
+
+  std::vector<llvm::Value *> callArgs;
 
-  if (!f->isVarArg()) {
-    if (args.size() > f->arg_size())
-      Error::compiler(U"too many arguments for function '" +
-                      std::stou32(id->getVal()) + U"'");
-    else if (args.size() < f->arg_size())
-      Error::compiler(U"too few arguments for function '" +
-                      std::stou32(id->getVal()) + U"'");
-    else if (args.size() != f->arg_size())
-      Error::compiler(U"invalid argument size for function '" +
-                      std::stou32(id->getVal()) + U"'");
+  // closures get their environment as the first argument
+  if (Compiler::isClosureTy(f->getType())) {
+    callArgs.push_back(ctx.builder->CreateExtractValue(f, 1));
+    f = ctx.builder->CreateExtractValue(f, 0);
   }
 
-  std::vector<llvm::Value *> callArgs;
+  auto ft =
+      llvm::cast<llvm::FunctionType>(f->getType()->getPointerElementType());
+  size_t argc = ft->getNumParams() - callArgs.size();
+
+  if (!ft->isVarArg()) {
+    if (args.size() > argc)
+      Error::compiler(U"too many arguments for function '" + name + U"'");
+    else if (args.size() < argc)
+      Error::compiler(U"too few arguments for function '" + name + U"'");
+  }
 
   for (size_t i = 0; i < args.size(); i++) {
-    auto v = args[i]->llvmValue(ctx);
-    auto v1 = f->isVarArg() && i >= f->arg_size()
-                  ? v
-                  : tryCast(ctx, v, f->getArg(i)->getType());
+    auto v = i < argVals.size() ? argVals[i] : args[i]->llvmValue(ctx);
+    if (ft->isVarArg() && i >= argc) {
+      callArgs.push_back(v);
+      continue;
+    }
+
+    auto argT = ft->getParamType(callArgs.size());
+    auto v1 = tryCast(ctx, v, argT);
     if (!v1)
-      Error::compiler(
-          U"invalid argument type for function '" + std::stou32(id->getVal()) +
-          U"' (expected: '" + Compiler::llvmTypeStr(f->getArg(i)->getType()) +
-          U"', got: '" + Compiler::llvmTypeStr(v->getType()) + U"')");
+      Error::compiler(U"invalid argument type for function '" + name +
+                      U"' (expected: '" + Compiler::llvmTypeStr(argT) +
+                      U"', got: '" + Compiler::llvmTypeStr(v->getType()) +
+                      U"')");
     callArgs.push_back(v1);
   }
 
-  auto call = ctx.builder->CreateCall(f, callArgs);
+  // calls with lambdas or functions as arguments get their own copy of the
+  // callee calling them directly
+  if (auto fn = llvm::dyn_cast<llvm::Function>(f))
+    f = ctx.specialize(fn, callArgs);
+
+  auto call = ctx.builder->CreateCall(ft, f, callArgs);
 
   return call;
 }
 
 bool AST::Call::isPtrElementCall(Compiler::Context &ctx) {
   auto id = callee->isIdentifier() ? (Identifier *)callee : nullptr;
-  bool b = callee->isLambda() || (!id && ctx.isFunction(id->getVal()));
+  bool b = callee->isLambda();
 
   if (!b && (!id || ctx.isVar(id->getVal()) || ctx.isFinal(id->getVal()))) {
     auto tmp = callee->llvmValue(ctx);
@@ -25,6 +25,31 @@ enum PT {
     TYPE_DOUBLE,
 };
 
+enum TypeInfoType {
+    TYPEINFO_SIZEOF,
+    TYPEINFO_ALIGNOF,
+    TYPEINFO_OFFSETOF,
+};
+
+enum AtomicType {
+    ATOMIC_LOAD,
+    ATOMIC_STORE,
+    ATOMIC_SWAP,
+    ATOMIC_CAS,
+    ATOMIC_ADD,
+    ATOMIC_SUB,
+    ATOMIC_AND,
+    ATOMIC_OR,
+    ATOMIC_XOR,
+    ATOMIC_FENCE,
+};
+
+enum CoroType {
+    CORO_RESUME,
+    CORO_PROMISE,
+    CORO_DESTROY,
+};
+
 enum BinExprType {
     BINEXPR_ADD,
     BINEXPR_SUB,
@@ -48,21 +73,44 @@ enum BinExprType {
     BINEXPR_LNOT,
 };
 
+// function attributes, given as '^<attr>' in front of the name of a 'defn' or
+// the arguments of a 'fn'
+enum FnAttr {
+    FN_INLINE   = 1 << 0,
+    FN_NOINLINE = 1 << 1,
+    FN_PURE     = 1 << 2,   // only reads memory
+    FN_CONST    = 1 << 3,   // does not access memory at all
+    FN_HOT      = 1 << 4,
+    FN_COLD     = 1 << 5,
+    FN_NORETURN = 1 << 6,
+    FN_ASYNC    = 1 << 7,   // a coroutine, calling it returns its handle
+};
+
 class Type {
 public:
     virtual ~Type() = default;
     virtual std::u32string str() = 0;
     virtual llvm::Type* llvmType(::Adscript::Compiler::Context &ctx) = 0;
+
+    virtual bool isRestrict() { return false; }
+
+    // infers the type parameters of a generic function (the ones in 'params'
+    // that are still nullptr) from a value of type 't' having this type
+    virtual void bind(llvm::Type *t, std::map<std::string, llvm::Type*>& params) {}
 };
 
 class Expr {
 public:
+    // position in the source file (0 if unknown)
+    unsigned line = 0, col = 0;
+
     virtual ~Expr() = default;
     virtual std::u32string str() = 0;
     virtual llvm::Value* llvmValue(::Adscript::Compiler::Context& ctx) = 0;
 
     virtual bool isLambda() { return false; }
     virtual bool isIdentifier() { return false; }
+    virtual bool isCall() { return false; }
     virtual bool isPtrElementCall(::Adscript::Compiler::Context& ctx) { return false; }
 };
 
@@ -88,13 +136,20 @@ class PointerType : public Type {
 private:
     Type *type;
     uint8_t quantity;
+
+    // the pointee is only accessed through this pointer while it is in
+    // scope ('T* restrict')
+    bool restrict;
 public:
-    PointerType(Type *type) : type(type), quantity(1) {}
-    PointerType(Type *type, uint8_t quantity)
-        : type(type), quantity(quantity) {}
+    PointerType(Type *type) : type(type), quantity(1), restrict(false) {}
+    PointerType(Type *type, uint8_t quantity, bool restrict = false)
+        : type(type), quantity(quantity), restrict(restrict) {}
 
     llvm::Type* llvmType(::Adscript::Compiler::Context& ctx) override;
     std::u32string str() override;
+    void bind(llvm::Type *t, std::map<std::string, llvm::Type*>& params) override;
+
+    bool isRestrict() override { return restrict; }
 
     ~PointerType() {
         delete type;
@@ -103,10 +158,18 @@ public:
 
 class StructType : public Type {
 private:
-    std::map<std::string, Type*> attrs;
+    // fields in declaration order
+    std::vector<std::pair<std::string, Type*>> attrs;
+
+    bool packed;
+    unsigned align;
+
+    // created once, so every use of this struct has the same llvm type
+    llvm::StructType *llvmT = nullptr;
 public:
-    StructType(const std::map<std::string, Type*>& attrs)
-        : attrs(attrs) {}
+    StructType(const std::vector<std::pair<std::string, Type*>>& attrs,
+               bool packed = false, unsigned align = 0)
+        : attrs(attrs), packed(packed), align(align) {}
 
     llvm::Type* llvmType(::Adscript::Compiler::Context& ctx) override;
     std::u32string str() override;
@@ -117,6 +180,59 @@ public:
     }
 };
 
+// structure of arrays of a struct type, one array per field
+class SoaType : public Type {
+private:
+    Type *type;
+
+    // created once, so every use of this type has the same llvm type
+    llvm::StructType *llvmT = nullptr;
+public:
+    SoaType(Type *type) : type(type) {}
+
+    llvm::Type* llvmType(::Adscript::Compiler::Context& ctx) override;
+    std::u32string str() override;
+
+    ~SoaType() {
+        delete type;
+    }
+};
+
+// handle of a coroutine ('^async' function) yielding and returning 'type'
+class AsyncType : public Type {
+private:
+    Type *type;
+public:
+    AsyncType(Type *type) : type(type) {}
+
+    llvm::Type* llvmType(::Adscript::Compiler::Context& ctx) override;
+    std::u32string str() override;
+
+    ~AsyncType() {
+        delete type;
+    }
+};
+
+// function taking the arguments 'args' and returning 'retType' together with
+// the environment of the variables it captured
+class ClosureType : public Type {
+private:
+    std::vector<Type*> args;
+    Type *retType;
+public:
+    ClosureType(std::vector<Type*>& args, Type *retType)
+        : args(args), retType(retType) {}
+
+    llvm::Type* llvmType(::Adscript::Compiler::Context& ctx) override;
+    std::u32string str() override;
+
+    ~ClosureType() {
+        for (auto& arg : args)
+            delete arg;
+        delete retType;
+    }
+};
+
 class IdentifierType : public Type {
 private:
     std::string id;
@@ -125,6 +241,7 @@ public:
 
     llvm::Type* llvmType(::Adscript::Compiler::Context& ctx) override;
     std::u32string str() override;
+    void bind(llvm::Type *t, std::map<std::string, llvm::Type*>& params) override;
 };
 
 class Int : public Expr {
@@ -276,6 +393,30 @@ public:
     }
 };
 
+// llvm ir (a module, i.e. function definitions and the declarations they
+// use) linked into the module, its functions are called like any other
+class NativeLLVM : public Expr {
+private:
+    const std::u32string ir;
+public:
+    NativeLLVM(const std::u32string& ir) : ir(ir) {}
+
+    llvm::Value* llvmValue(::Adscript::Compiler::Context& ctx) override;
+    std::u32string str() override;
+};
+
+// c code compiled with clang and linked into the module, its functions are
+// called like any other
+class NativeC : public Expr {
+private:
+    const std::u32string code;
+public:
+    NativeC(const std::u32string& code) : code(code) {}
+
+    llvm::Value* llvmValue(::Adscript::Compiler::Context& ctx) override;
+    std::u32string str() override;
+};
+
 class Let : public Expr {
 private:
     Expr *val;
@@ -382,6 +523,212 @@ public:
     }
 };
 
+class Get : public Expr {
+private:
+    Expr *ptr;
+    std::string field;
+public:
+    Get(Expr *ptr, const std::string& field) : ptr(ptr), field(field) {}
+
+    llvm::Value* llvmValue(::Adscript::Compiler::Context& ctx) override;
+    std::u32string str() override;
+
+    // fields can be assigned like array elements
+    bool isPtrElementCall(::Adscript::Compiler::Context& ctx) override {
+        return true;
+    }
+
+    ~Get() {
+        delete ptr;
+    }
+};
+
+// bytes needed for the arrays of a soa collection of n elements
+class SoaSize : public Expr {
+private:
+    Type *type;
+    Expr *n;
+public:
+    SoaSize(Type *type, Expr *n) : type(type), n(n) {}
+
+    llvm::Value* llvmValue(::Adscript::Compiler::Context& ctx) override;
+    std::u32string str() override;
+
+    ~SoaSize() {
+        delete type;
+        delete n;
+    }
+};
+
+// points the arrays of a soa collection into a buffer of 'soa-size' bytes
+class SoaInit : public Expr {
+private:
+    Expr *soa, *buf, *n;
+public:
+    SoaInit(Expr *soa, Expr *buf, Expr *n) : soa(soa), buf(buf), n(n) {}
+
+    llvm::Value* llvmValue(::Adscript::Compiler::Context& ctx) override;
+    std::u32string str() override;
+
+    ~SoaInit() {
+        delete soa;
+        delete buf;
+        delete n;
+    }
+};
+
+// runs 'body' for every 'id' in [start, end) on the threads of the runtime
+class ParallelFor : public Expr {
+private:
+    std::string id;
+    Expr *start, *end;
+    std::vector<Expr*> body;
+    // variables initialized before the loop (i.e. the operands of 'pmap')
+    std::vector<std::pair<std::string, Expr*>> vars;
+public:
+    ParallelFor(const std::string& id, Expr *start, Expr *end,
+                std::vector<Expr*>& body,
+                const std::vector<std::pair<std::string, Expr*>>& vars = {})
+        : id(id), start(start), end(end), body(body), vars(vars) {}
+
+    llvm::Value* llvmValue(::Adscript::Compiler::Context& ctx) override;
+    std::u32string str() override;
+
+    ~ParallelFor() {
+        delete start;
+        delete end;
+        for (auto& expr : body)
+            delete expr;
+        for (auto& var : vars)
+            delete var.second;
+    }
+};
+
+// runs 'expr' as a task other threads may steal, until the next 'Sync'
+class Spawn : public Expr {
+private:
+    Expr *expr;
+public:
+    Spawn(Expr *expr) : expr(expr) {}
+
+    llvm::Value* llvmValue(::Adscript::Compiler::Context& ctx) override;
+    std::u32string str() override;
+
+    ~Spawn() {
+        delete expr;
+    }
+};
+
+// waits for the tasks spawned by the current function
+class Sync : public Expr {
+public:
+    llvm::Value* llvmValue(::Adscript::Compiler::Context& ctx) override;
+    std::u32string str() override;
+};
+
+// runs 'body' as long as 'cond' is true
+class While : public Expr {
+private:
+    Expr *cond;
+    std::vector<Expr*> body;
+public:
+    While(Expr *cond, std::vector<Expr*>& body) : cond(cond), body(body) {}
+
+    llvm::Value* llvmValue(::Adscript::Compiler::Context& ctx) override;
+    std::u32string str() override;
+
+    ~While() {
+        delete cond;
+        for (auto& expr : body)
+            delete expr;
+    }
+};
+
+// suspends the current coroutine, making 'val' (if any) its promise
+class Yield : public Expr {
+private:
+    Expr *val;
+public:
+    Yield(Expr *val) : val(val) {}
+
+    llvm::Value* llvmValue(::Adscript::Compiler::Context& ctx) override;
+    std::u32string str() override;
+
+    ~Yield() {
+        delete val;
+    }
+};
+
+// runs the coroutine 'handle' to its end (suspending the current coroutine
+// every time it suspends), destroys it and returns its result
+class Await : public Expr {
+private:
+    Expr *handle;
+public:
+    Await(Expr *handle) : handle(handle) {}
+
+    llvm::Value* llvmValue(::Adscript::Compiler::Context& ctx) override;
+    std::u32string str() override;
+
+    ~Await() {
+        delete handle;
+    }
+};
+
+// resumes, gets the promise of or destroys the coroutine 'handle'
+class Coro : public Expr {
+private:
+    CoroType ct;
+    Expr *handle;
+public:
+    Coro(CoroType ct, Expr *handle) : ct(ct), handle(handle) {}
+
+    llvm::Value* llvmValue(::Adscript::Compiler::Context& ctx) override;
+    std::u32string str() override;
+
+    ~Coro() {
+        delete handle;
+    }
+};
+
+// atomic memory access (or fence) through the pointer that is the first
+// argument, with the memory orderings given (sequentially consistent if not)
+class Atomic : public Expr {
+private:
+    AtomicType at;
+    std::vector<Expr*> args;
+    std::vector<llvm::AtomicOrdering> orders;
+public:
+    Atomic(AtomicType at, std::vector<Expr*>& args,
+           std::vector<llvm::AtomicOrdering>& orders)
+        : at(at), args(args), orders(orders) {}
+
+    llvm::Value* llvmValue(::Adscript::Compiler::Context& ctx) override;
+    std::u32string str() override;
+
+    ~Atomic() {
+        for (auto& arg : args)
+            delete arg;
+    }
+};
+
+class TypeInfo : public Expr {
+private:
+    TypeInfoType tit;
+    Type *type;
+    std::string field;
+public:
+    TypeInfo(TypeInfoType tit, Type *type, const std::string& field = "")
+        : tit(tit), type(type), field(field) {}
+
+    llvm::Value* llvmValue(::Adscript::Compiler::Context& ctx) override;
+    std::u32string str() override;
+
+    ~TypeInfo() {
+        delete type;
+    }
+};
+
 class Cast : public Expr {
 private:
     Type *type;
@@ -406,11 +753,37 @@ private:
     std::vector<Expr*> body;
 
     bool varArg = false;
+    unsigned attrs = 0;
+
+    // source text of the whole 'defn' form, used as cache fingerprint
+    std::u32string src;
+
+    // type parameters of generic functions, which are instantiated for the
+    // types of the arguments they are called with
+    std::vector<std::string> typeParams;
+
+    // generates the function (or an instance of a generic one) named 'name'
+    llvm::Function* define(::Adscript::Compiler::Context& ctx,
+                           const std::string& name, bool cache);
 public:
+    // file the function is defined in
+    std::string file;
+
     Function(const std::string& id, 
                 const std::vector<std::pair<std::string, Type*>>& args,
-                Type *retType, std::vector<Expr*>& body, bool varArg)
-        : id(id), args(args), retType(retType), body(body), varArg(varArg) {}
+                Type *retType, std::vector<Expr*>& body, bool varArg,
+                unsigned attrs = 0)
+        : id(id), args(args), retType(retType), body(body), varArg(varArg),
+          attrs(attrs) {}
+
+    void setSrc(const std::u32string& src) { this->src = src; }
+    void setTypeParams(const std::vector<std::string>& typeParams) {
+        this->typeParams = typeParams;
+    }
+
+    // the instance of the generic function for the types of 'argVals'
+    llvm::Function* instantiate(::Adscript::Compiler::Context& ctx,
+                                const std::vector<llvm::Value*>& argVals);
 
     llvm::Value* llvmValue(::Adscript::Compiler::Context& ctx) override;
     std::u32string str() override;
@@ -430,10 +803,13 @@ private:
     std::vector<Expr*> body;
 
     bool varArg = false;
+    unsigned attrs = 0;
 public:
     Lambda(std::vector<std::pair<std::string, Type*>>& args,
-            Type *retType, std::vector<Expr*>& body, bool varArg = false)
-        : args(args), retType(retType), body(body), varArg(varArg) {}
+            Type *retType, std::vector<Expr*>& body, bool varArg = false,
+            unsigned attrs = 0)
+        : args(args), retType(retType), body(body), varArg(varArg),
+          attrs(attrs) {}
 
     llvm::Value* llvmValue(::Adscript::Compiler::Context& ctx) override;
     std::u32string str() override;
@@ -441,7 +817,7 @@ public:
     bool isLambda() override { return true; }
 
     Function* toFunc(const std::string& id) {
-        return new Function(id, args, retType, body, varArg);
+        return new Function(id, args, retType, body, varArg, attrs);
     }
 
     ~Lambda() {
@@ -464,6 +840,7 @@ public:
     std::u32string str() override;
 
     bool isPtrElementCall(::Adscript::Compiler::Context& ctx) override;
+    bool isCall() override { return true; }
 
     ~Call() {
         delete callee;
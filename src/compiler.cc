@@ -1,5 +1,9 @@
 #include "utils.hh"
+#include "trace.hh"
 #include "compiler.hh"
+#include "lexerparser.hh"
+
+#include <llvm/Config/llvm-config.h>
 
 #include <llvm/IR/Module.h>
 #include <llvm/IR/IRBuilder.h>
@@ -7,28 +11,406 @@
 
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/IR/DiagnosticInfo.h>
+#include <llvm/IR/DiagnosticHandler.h>
+#include <llvm/IR/LLVMRemarkStreamer.h>
+#include <llvm/IR/Verifier.h>
+
+#include <llvm/AsmParser/Parser.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ModuleUtils.h>
+#include <llvm/Transforms/Utils/EntryExitInstrumenter.h>
+#include <llvm/Transforms/Instrumentation/InstrProfiling.h>
+#include <llvm/Transforms/Instrumentation/PGOInstrumentation.h>
+#include <llvm/Transforms/IPO/SampleProfile.h>
+#include <llvm/Transforms/Utils/AddDiscriminators.h>
+#include <llvm/Transforms/Vectorize/LoopVectorize.h>
+#include <llvm/Transforms/Vectorize/SLPVectorizer.h>
+#include <llvm/Transforms/InstCombine/InstCombine.h>
+#include <llvm/Transforms/Coroutines/CoroCleanup.h>
+#include <llvm/Transforms/Coroutines/CoroEarly.h>
+#include <llvm/Transforms/Coroutines/CoroElide.h>
+#include <llvm/Transforms/Coroutines/CoroSplit.h>
 
 #include <llvm/Target/TargetMachine.h>
 #include <llvm/Target/TargetOptions.h>
 
 #include <llvm/Support/Host.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Program.h>
 #include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/SourceMgr.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Support/TargetRegistry.h>
+#include <llvm/Support/ToolOutputFile.h>
+#include <llvm/Support/WithColor.h>
+#include <llvm/Support/Regex.h>
 
 #include <llvm/CodeGen/Passes.h>
 #include <llvm/CodeGen/MachineModuleInfo.h>
 
+#include <set>
+#include <algorithm>
 #include <memory>
 #include <fstream>
 #include <iostream>
+#include <cerrno>
+#include <cstring>
 
 #include <unistd.h>
 
 using namespace Adscript;
 
+Compiler::Context::Context(llvm::Module *mod, llvm::IRBuilder<> *builder, const Options &opts)
+    : tm(createTargetMachine(opts.target)), mod(mod), builder(builder), opts(opts) {
+    // the optimizer needs to know the target's types and vector registers
+    mod->setDataLayout(tm->createDataLayout());
+
+    // record a trace span for every pass that is run
+    if (Trace::enabled()) {
+        pic.registerBeforeNonSkippedPassCallback(
+            [](llvm::StringRef pass, llvm::Any) { Trace::begin(pass.str()); });
+        // the callback signatures differ between llvm versions
+        pic.registerAfterPassCallback(
+            [](llvm::StringRef, auto&&...) { Trace::end(); });
+        pic.registerAfterPassInvalidatedCallback(
+            [](llvm::StringRef, auto&&...) { Trace::end(); });
+    }
+
+#if LLVM_VERSION_MAJOR < 13
+    llvm::PassBuilder passBuilder(false, tm.get(), llvm::PipelineTuningOptions(),
+                                  llvm::None, &pic);
+#else
+    llvm::PassBuilder passBuilder(tm.get(), llvm::PipelineTuningOptions(),
+                                  llvm::None, &pic);
+#endif
+
+    passBuilder.registerModuleAnalyses   (mam);
+    passBuilder.registerCGSCCAnalyses    (gam);
+    passBuilder.registerFunctionAnalyses (fam);
+    passBuilder.registerLoopAnalyses     (lam);
+
+    passBuilder.crossRegisterProxies(lam, fam, gam, mam);
+
+    // calls of coroutines (with the functions creating them inlined) are
+    // lowered first, so the frames of the ones not outliving the caller are
+    // put on its stack
+    fpm.addPass(llvm::CoroEarlyPass());
+    fpm.addPass(llvm::CoroElidePass());
+    fpm.addPass(passBuilder.buildFunctionSimplificationPipeline(
+        llvm::PassBuilder::OptimizationLevel::O3,
+        llvm::ThinOrFullLTOPhase::None));
+
+    // the simplification pipeline does not vectorize
+    fpm.addPass(llvm::LoopVectorizePass());
+    fpm.addPass(llvm::SLPVectorizerPass());
+    fpm.addPass(llvm::InstCombinePass());
+
+    if (opts.debugInfo) {
+        dib = std::make_unique<llvm::DIBuilder>(*mod);
+        mod->addModuleFlag(llvm::Module::Warning, "Debug Info Version",
+                           llvm::DEBUG_METADATA_VERSION);
+        mod->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 4);
+    }
+}
+
+llvm::DIFile* Compiler::Context::getDIFile(const std::string& path) {
+    auto it = diFiles.find(path);
+    if (it != diFiles.end()) return it->second;
+
+    llvm::SmallString<128> abs(path);
+    llvm::sys::fs::make_absolute(abs);
+    auto file = dib->createFile(llvm::sys::path::filename(abs),
+                                llvm::sys::path::parent_path(abs));
+    diFiles[path] = file;
+    return file;
+}
+
+llvm::DIScope* Compiler::Context::beginDebugScope(llvm::Function *f,
+        const std::string& path, unsigned line, unsigned col) {
+    if (!dib) return nullptr;
+
+    // lambdas are in the file of the function they are defined in
+    auto file = path.empty() && diScope ? diScope->getFile()
+        : getDIFile(path.empty() ? mod->getName().str() : path);
+
+    // the compile unit is named after the first file that has code in it
+    if (!diCU) diCU = dib->createCompileUnit(llvm::dwarf::DW_LANG_C, file,
+        "Adscript", true, "", 0, "", llvm::DICompileUnit::LineTablesOnly, 0,
+        true, true);
+
+    auto spFlags = llvm::DISubprogram::SPFlagDefinition
+        | llvm::DISubprogram::SPFlagOptimized;
+    if (f->hasLocalLinkage()) spFlags |= llvm::DISubprogram::SPFlagLocalToUnit;
+
+    auto sp = dib->createFunction(file, f->getName(), f->getName(), file, line,
+        dib->createSubroutineType(dib->getOrCreateTypeArray({})), line,
+        llvm::DINode::FlagPrototyped, spFlags);
+    f->setSubprogram(sp);
+
+    auto prev = diScope;
+    diScope = sp;
+    builder->SetCurrentDebugLocation(
+        llvm::DILocation::get(mod->getContext(), line, col, sp));
+    return prev;
+}
+
+void Compiler::Context::endDebugScope(llvm::DIScope *prev) {
+    if (!dib) return;
+    dib->finalizeSubprogram(llvm::cast<llvm::DISubprogram>(diScope));
+    diScope = prev;
+    builder->SetCurrentDebugLocation(llvm::DebugLoc());
+}
+
+std::string Compiler::Context::localName(const std::string& kind,
+        unsigned line) {
+    auto bb = builder->GetInsertBlock();
+    std::string name = bb ? bb->getParent()->getName().str() + "." : "";
+    name += kind;
+    if (line) name += "." + std::to_string(line);
+    return name;
+}
+
+llvm::MDNode* Compiler::Context::tbaaTag(llvm::Type *t) {
+    auto it = tbaaTags.find(t);
+    if (it != tbaaTags.end()) return it->second;
+
+    llvm::MDBuilder md(mod->getContext());
+
+    // like in c, chars may alias anything and all pointers may alias each
+    // other, aggregates are left untagged
+    if (!tbaaRoot) tbaaRoot = md.createTBAARoot("Adscript TBAA");
+    auto charNode = md.createTBAAScalarTypeNode("omnipotent char", tbaaRoot);
+
+    llvm::MDNode *node = nullptr;
+    if (t->isIntegerTy(8))
+        node = charNode;
+    else if (t->isPointerTy())
+        node = md.createTBAAScalarTypeNode("any pointer", charNode);
+    else if (t->isIntegerTy() || t->isFloatingPointTy())
+        node = md.createTBAAScalarTypeNode(
+            std::to_string(llvmTypeStr(t)), charNode);
+
+    auto tag = node ? md.createTBAAStructTagNode(node, node, 0) : nullptr;
+    tbaaTags[t] = tag;
+    return tag;
+}
+
+void Compiler::Context::addTBAA(llvm::Instruction *inst) {
+    llvm::Type *t = nullptr;
+    if (auto load = llvm::dyn_cast<llvm::LoadInst>(inst))
+        t = load->getType();
+    else if (auto store = llvm::dyn_cast<llvm::StoreInst>(inst))
+        t = store->getValueOperand()->getType();
+
+    if (auto tag = t ? tbaaTag(t) : nullptr)
+        inst->setMetadata(llvm::LLVMContext::MD_tbaa, tag);
+}
+
+Compiler::LocScope::LocScope(Context &ctx, AST::Expr *expr)
+    : ctx(ctx), prev(ctx.builder->getCurrentDebugLocation()) {
+    if (!ctx.diScope || !expr->line) return;
+    ctx.builder->SetCurrentDebugLocation(llvm::DILocation::get(
+        ctx.mod->getContext(), expr->line, expr->col, ctx.diScope));
+}
+
+Compiler::LocScope::~LocScope() {
+    ctx.builder->SetCurrentDebugLocation(prev);
+}
+
 bool Compiler::Context::isVar(const std::string& id) {
-    return varScope.find(id) != varScope.end();
+    return varScope.find(id) != varScope.end()
+        || (!closures.empty() && capture(id, closures.size()));
+}
+
+bool Compiler::Context::capture(const std::string& id, size_t level) {
+    auto& vars = level == closures.size() ? varScope : closures[level].outer;
+    if (vars.find(id) != vars.end()) return true;
+    if (!level || !capture(id, level - 1)) return false;
+
+    auto& c = closures[level - 1];
+    auto var = c.outer[id];
+
+    if (c.byRef) {
+        // loaded from the environment before anything else is run
+        auto ptrT = llvm::Type::getInt8PtrTy(mod->getContext());
+        llvm::IRBuilder<> b(c.f->getEntryBlock().getTerminator());
+        auto env = b.CreatePointerCast(c.f->getArg(0), ptrT->getPointerTo());
+        auto ptr = b.CreateLoad(ptrT,
+            b.CreateConstGEP1_64(ptrT, env, c.captures.size()));
+        auto varPtr = b.CreatePointerCast(ptr, var.first->getPointerTo());
+
+        vars[id] = { var.first, varPtr };
+        c.captures.push_back({ var, varPtr });
+        return true;
+    }
+
+    // captured by value, the lambda works on a copy initialized from its
+    // environment
+    auto copy = createAlloca(c.f, var.first, getAlign(var.first));
+
+    vars[id] = { var.first, copy };
+    c.captures.push_back({ var, copy });
+    return true;
+}
+
+// whether closure environment 'v' (or a value holding it) may be used after
+// the function creating it returned
+static bool envEscapes(llvm::Value *v, std::set<llvm::Value*>& visited) {
+    if (!visited.insert(v).second) return false;
+
+    for (auto user : v->users()) {
+        auto inst = llvm::dyn_cast<llvm::Instruction>(user);
+        if (!inst) return true;
+
+        if (llvm::isa<llvm::LoadInst>(inst) || llvm::isa<llvm::CmpInst>(inst))
+            continue;
+
+        if (auto store = llvm::dyn_cast<llvm::StoreInst>(inst)) {
+            if (store->getValueOperand() != v) continue;
+
+            // only follow variables that are not referenced
+            auto var = llvm::dyn_cast<llvm::AllocaInst>(
+                store->getPointerOperand());
+            if (!var) return true;
+            for (auto varUser : var->users()) {
+                auto varStore = llvm::dyn_cast<llvm::StoreInst>(varUser);
+                if (varStore && varStore->getPointerOperand() == var) continue;
+                if (!llvm::isa<llvm::LoadInst>(varUser)
+                        || envEscapes(varUser, visited))
+                    return true;
+            }
+        } else if (auto call = llvm::dyn_cast<llvm::CallBase>(inst)) {
+            if (call->getCalledOperand() == v) continue;
+
+            auto callee = call->getCalledFunction();
+            for (unsigned i = 0; i < call->arg_size(); i++) {
+                if (call->getArgOperand(i) != v) continue;
+
+                // closures never leak their own environment
+                auto fn = llvm::dyn_cast<llvm::ExtractValueInst>(
+                    call->getCalledOperand());
+                if (!callee && i == 0 && fn && fn->getIndices()[0] == 0
+                        && Compiler::isClosureTy(
+                            fn->getAggregateOperand()->getType()))
+                    continue;
+
+                if (!callee || callee->isDeclaration()
+                        || i >= callee->arg_size()
+                        || envEscapes(callee->getArg(i), visited))
+                    return true;
+            }
+        } else if (llvm::isa<llvm::CastInst>(inst)
+                || llvm::isa<llvm::GetElementPtrInst>(inst)
+                || llvm::isa<llvm::InsertValueInst>(inst)
+                || llvm::isa<llvm::ExtractValueInst>(inst)
+                || llvm::isa<llvm::PHINode>(inst)
+                || llvm::isa<llvm::SelectInst>(inst)) {
+            if (envEscapes(inst, visited)) return true;
+        } else return true;
+    }
+
+    return false;
+}
+
+void Compiler::Context::placeClosureEnvs(llvm::Function *f) {
+    auto& c = mod->getContext();
+    auto it = closureEnvs.begin();
+    while (it != closureEnvs.end()) {
+        auto env = it->first;
+        auto creation = it->second;
+        if (env->getFunction() != f) {
+            it++;
+            continue;
+        }
+        it = closureEnvs.erase(it);
+
+        std::set<llvm::Value*> visited;
+        if (!envEscapes(env, visited)) continue;
+
+        // allocated in the arena of the runtime every time the closure is
+        // created, until it is released (see runtime/arena.c)
+        auto alloc = mod->getOrInsertFunction("adscript_arena_alloc",
+            llvm::Type::getInt8PtrTy(c), llvm::Type::getInt64Ty(c));
+        auto size = mod->getDataLayout().getTypeAllocSize(
+            env->getAllocatedType());
+
+        llvm::IRBuilder<> b(creation);
+        auto mem = b.CreateCall(alloc, { b.getInt64(size) });
+        env->replaceAllUsesWith(b.CreatePointerCast(mem, env->getType()));
+        env->eraseFromParent();
+    }
+}
+
+// whether heterogeneous array 'v' (or a value holding it) may be written to
+// by anything but the stores 'init' initializing it
+static bool heWritten(llvm::Value *v,
+                      const std::vector<llvm::StoreInst*>& init,
+                      std::set<llvm::Value*>& visited) {
+    if (!visited.insert(v).second) return false;
+
+    for (auto user : v->users()) {
+        auto inst = llvm::dyn_cast<llvm::Instruction>(user);
+        if (!inst) return true;
+
+        if (llvm::isa<llvm::LoadInst>(inst) || llvm::isa<llvm::CmpInst>(inst))
+            continue;
+
+        if (auto store = llvm::dyn_cast<llvm::StoreInst>(inst)) {
+            if (store->getValueOperand() != v) {
+                if (std::find(init.begin(), init.end(), store) == init.end())
+                    return true;
+                continue;
+            }
+
+            // only follow variables that are not referenced or assigned
+            // other values
+            auto var = llvm::dyn_cast<llvm::AllocaInst>(
+                store->getPointerOperand());
+            if (!var) return true;
+            for (auto varUser : var->users()) {
+                auto varStore = llvm::dyn_cast<llvm::StoreInst>(varUser);
+                if (varStore && varStore->getPointerOperand() == var
+                        && varStore->getValueOperand() == v)
+                    continue;
+                if (!llvm::isa<llvm::LoadInst>(varUser)
+                        || heWritten(varUser, init, visited))
+                    return true;
+            }
+        } else if (llvm::isa<llvm::CastInst>(inst)
+                || llvm::isa<llvm::GetElementPtrInst>(inst)
+                || llvm::isa<llvm::PHINode>(inst)
+                || llvm::isa<llvm::SelectInst>(inst)) {
+            if (heWritten(inst, init, visited)) return true;
+        } else return true;
+    }
+
+    return false;
+}
+
+void Compiler::Context::forwardHeLoads(llvm::Function *f) {
+    auto it = heLoads.begin();
+    while (it != heLoads.end()) {
+        if (it->load->getFunction() != f) {
+            it++;
+            continue;
+        }
+
+        // arrays passed to other functions could be written to by them
+        std::set<llvm::Value*> visited;
+        if (!heWritten(it->tuple->array, it->tuple->init, visited)) {
+            it->load->replaceAllUsesWith(it->elem);
+            it->load->eraseFromParent();
+        }
+        it = heLoads.erase(it);
+    }
 }
 
 bool Compiler::Context::isType(const std::string& id) {
@@ -46,6 +428,26 @@ bool Compiler::Context::isFunction(const std::string& id) {
     return false;
 }
 
+int Compiler::Context::fieldIndex(llvm::StructType *t, const std::string& field) {
+    auto& fields = structs[t].fields;
+    for (size_t i = 0; i < fields.size(); i++) {
+        if (fields[i] == field) return i;
+    }
+    return -1;
+}
+
+unsigned Compiler::Context::getAlign(llvm::Type *t) {
+    unsigned align = mod->getDataLayout().getABITypeAlignment(t);
+    if (auto at = llvm::dyn_cast<llvm::ArrayType>(t))
+        return std::max(align, getAlign(at->getElementType()));
+    if (auto st = llvm::dyn_cast<llvm::StructType>(t)) {
+        auto it = structs.find(st);
+        if (it != structs.end() && it->second.align > align)
+            align = it->second.align;
+    }
+    return align;
+}
+
 Compiler::ctx_var_t Compiler::Context::getVar(const std::string& id) {
     if (isVar(id)) return varScope[id];
     return { nullptr, nullptr };
@@ -61,9 +463,665 @@ llvm::Function* Compiler::Context::getFunction(const std::string& id) {
     return nullptr;
 }
 
+// functions are optimized one at a time without an inliner pass, so calls to
+// '^inline' functions are inlined right before optimizing the caller
+bool Compiler::Context::inlineCalls(llvm::Function *f,
+                                    const std::set<llvm::Function*>& callees) {
+    std::vector<llvm::CallBase*> calls;
+    for (auto& bb : *f) {
+        for (auto& inst : bb) {
+            auto call = llvm::dyn_cast<llvm::CallBase>(&inst);
+            if (!call) continue;
+            auto callee = call->getCalledFunction();
+            // coroutines can only be inlined once they are split
+            if (callee && callee != f && !callee->isDeclaration()
+                && !callee->hasFnAttribute("coroutine.presplit")
+                && (callee->hasFnAttribute(llvm::Attribute::AlwaysInline)
+                    || callees.count(callee)))
+                calls.push_back(call);
+        }
+    }
+
+    for (auto call : calls) {
+        llvm::InlineFunctionInfo info;
+        llvm::InlineFunction(*call, info);
+    }
+    return !calls.empty();
+}
+
+// maximum number of instructions of functions that are specialized and of
+// functions inlined into the specializations
+static const size_t specializeBudget = 256;
+
+// the function 'v' (a function or a closure) calls, if it is known statically
+static llvm::Function* knownFunction(llvm::Value *v) {
+    if (Compiler::isClosureTy(v->getType())) {
+        // the environment is inserted last
+        auto env = llvm::dyn_cast<llvm::InsertValueInst>(v);
+        if (env && env->getIndices()[0] == 1)
+            v = env->getAggregateOperand();
+
+        auto fn = llvm::dyn_cast<llvm::InsertValueInst>(v);
+        if (auto c = llvm::dyn_cast<llvm::Constant>(v))
+            v = c->getAggregateElement(0u);
+        else if (fn && fn->getIndices()[0] == 0)
+            v = fn->getInsertedValueOperand();
+        else return nullptr;
+    }
+
+    auto f = llvm::dyn_cast_or_null<llvm::Function>(
+        v ? v->stripPointerCasts() : nullptr);
+    return f && !f->isDeclaration() ? f : nullptr;
+}
+
+// whether all blocks of 'f' are terminated, functions that are generated at
+// the moment (the caller and the functions it is nested in) can't be copied
+static bool isComplete(llvm::Function *f) {
+    for (auto& bb : *f)
+        if (!bb.getTerminator()) return false;
+    return true;
+}
+
+llvm::Function* Compiler::Context::specialize(llvm::Function *f,
+        const std::vector<llvm::Value*>& args) {
+    // profiles are applied to the functions as they were written, and
+    // functions that are generated at the moment are not complete yet
+    if (usesPGO() || f->isDeclaration() || f->isVarArg()
+            || asyncValueType(f->getReturnType())
+            || f->getInstructionCount() > specializeBudget
+            || !isComplete(f))
+        return f;
+
+    bool any = false;
+    std::vector<llvm::Function*> known;
+    for (size_t i = 0; i < args.size() && i < f->arg_size(); i++) {
+        auto t = f->getArg(i)->getType();
+        auto fn = isFunctionTy(t) || isClosureTy(t)
+            ? knownFunction(args[i]) : nullptr;
+        known.push_back(fn && isComplete(fn) ? fn : nullptr);
+        any |= known.back() != nullptr;
+    }
+    if (!any) return f;
+
+    specialized++;
+
+    auto& spec = specializations[{ f, known }];
+    if (spec) return spec;
+
+    Trace::Scope scope("Specialize", f->getName().str());
+
+    llvm::ValueToValueMapTy vmap;
+    spec = llvm::CloneFunction(f, vmap);
+    spec->setLinkage(llvm::Function::PrivateLinkage);
+    spec->setName(f->getName() + ".spec");
+
+    llvm::IRBuilder<> b(&*spec->getEntryBlock().getFirstInsertionPt());
+    std::vector<llvm::Value*> replaced(known.size());
+    std::set<llvm::Function*> inlined;
+
+    for (size_t i = 0; i < known.size(); i++) {
+        if (!known[i]) continue;
+        auto arg = spec->getArg(i);
+
+        if (isClosureTy(arg->getType())) {
+            // only the environment is still passed
+            auto st = llvm::cast<llvm::StructType>(arg->getType());
+            auto env = b.CreateExtractValue(arg, 1);
+            auto closure = b.CreateInsertValue(llvm::UndefValue::get(st),
+                b.CreatePointerCast(known[i], st->getElementType(0)), 0);
+            replaced[i] = b.CreateInsertValue(closure, env, 1);
+            arg->replaceUsesWithIf(replaced[i],
+                [&](llvm::Use& u) { return u.getUser() != env; });
+        } else {
+            replaced[i] = b.CreatePointerCast(known[i], arg->getType());
+            arg->replaceAllUsesWith(replaced[i]);
+        }
+
+        if (known[i]->getInstructionCount() <= specializeBudget)
+            inlined.insert(known[i]);
+    }
+
+    // recursive calls passing the same functions on call the clone
+    for (auto& bb : *spec) {
+        for (auto& inst : bb) {
+            auto call = llvm::dyn_cast<llvm::CallBase>(&inst);
+            if (!call || call->getCalledFunction() != f) continue;
+
+            bool same = true;
+            for (size_t i = 0; i < replaced.size(); i++)
+                same &= !replaced[i] || call->getArgOperand(i) == replaced[i];
+            if (same) call->setCalledFunction(spec);
+        }
+    }
+
+    // and the functions they call (i.e. the one a thunk wraps)
+    std::set<llvm::Function*> inlinedCallees;
+    for (auto fn : inlined) {
+        for (auto& bb : *fn) {
+            for (auto& inst : bb) {
+                auto call = llvm::dyn_cast<llvm::CallBase>(&inst);
+                auto callee = call ? call->getCalledFunction() : nullptr;
+                if (callee && !callee->isDeclaration()
+                        && callee->getInstructionCount() <= specializeBudget
+                        && isComplete(callee))
+                    inlinedCallees.insert(callee);
+            }
+        }
+    }
+
+    // the first run turns the calls of the known functions into direct ones
+    fpm.run(*spec, fam);
+    inlineCalls(spec, inlined);
+    inlineCalls(spec, inlinedCallees);
+    fpm.run(*spec, fam);
+
+    return spec;
+}
+
+llvm::PointerType* Compiler::Context::getAsyncType(llvm::Type *t) {
+    auto& handleT = asyncTypes[t];
+    if (!handleT) {
+        // an opaque struct, a handle points to the frame of the coroutine
+        handleT = llvm::StructType::create(mod->getContext(), "async")->getPointerTo();
+        asyncValues[handleT] = t;
+    }
+    return handleT;
+}
+
+llvm::Type* Compiler::Context::asyncValueType(llvm::Type *t) {
+    auto it = asyncValues.find(t);
+    return it == asyncValues.end() ? nullptr : it->second;
+}
+
+void Compiler::Context::suspend(bool final) {
+    auto& c = mod->getContext();
+    auto f = builder->GetInsertBlock()->getParent();
+
+    auto suspendF = llvm::Intrinsic::getDeclaration(mod, llvm::Intrinsic::coro_suspend);
+    auto state = builder->CreateCall(suspendF, {
+        llvm::ConstantTokenNone::get(c), builder->getInt1(final) });
+
+    // -1: suspended, 0: resumed, 1: destroyed
+    auto resumeBB = llvm::BasicBlock::Create(c, "resume", f);
+    auto sw = builder->CreateSwitch(state, coroutine->suspend, 2);
+    if (!final) sw->addCase(builder->getInt8(0), resumeBB);
+    sw->addCase(builder->getInt8(1), coroutine->cleanup);
+
+    builder->SetInsertPoint(resumeBB);
+    if (final) builder->CreateUnreachable();
+}
+
+void Compiler::Context::splitCoroutine(llvm::Function *f) {
+    Trace::Scope scope("SplitCoroutine", f->getName().str());
+
+    // simplified first, so less values live across suspensions (and have to
+    // be stored in the frame)
+    runFPM(f);
+    fam.invalidate(*f, llvm::CoroEarlyPass().run(*f, fam));
+
+    // the call graph changed since it was split the last time
+    mam.invalidate(*mod, llvm::PreservedAnalyses::none());
+
+    llvm::ModulePassManager mpm;
+    mpm.addPass(llvm::createModuleToPostOrderCGSCCPassAdaptor(llvm::CoroSplitPass()));
+    mpm.run(*mod, mam);
+
+    // the functions resuming and destroying it, inlined where they are
+    // called directly (once the frame is known to be on the stack)
+    for (auto suffix : { ".resume", ".destroy", ".cleanup" }) {
+        auto clone = mod->getFunction((f->getName() + suffix).str());
+        runFPM(clone);
+        if (clone) clone->addFnAttr(llvm::Attribute::AlwaysInline);
+    }
+
+    f->removeFnAttr(llvm::Attribute::NoInline);
+    f->addFnAttr(llvm::Attribute::AlwaysInline);
+    runFPM(f);
+}
+
+std::string tempfile(const std::string& suffix = ".o") {
+    std::string file = "/tmp/adscript-XXXXXXXX" + suffix;
+    int fd = mkstemps(&file[0], suffix.size());
+    if (fd < 0)
+        Error::compiler(U"cannot create temporary file '" + std::stou32(file)
+            + U"': " + std::stou32(std::strerror(errno)));
+    close(fd);
+    return file;
+}
+
+std::vector<llvm::Function*> Compiler::Context::linkNative(
+        std::unique_ptr<llvm::Module> m, const std::string& src, const std::u32string& form) {
+    std::string msg;
+    llvm::raw_string_ostream os(msg);
+    if (llvm::verifyModule(*m, &os))
+        Error::compiler(U"invalid llvm ir in '" + form + U"' expression: " + std::stou32(os.str()));
+
+    // it is compiled for the target of the module
+    m->setDataLayout(mod->getDataLayout());
+    m->setTargetTriple(mod->getTargetTriple());
+
+    std::vector<std::string> names;
+    for (auto& f : *m) {
+        if (f.isDeclaration() || f.hasLocalLinkage()) continue;
+
+        auto prev = mod->getFunction(f.getName());
+        if (prev && !prev->isDeclaration())
+            Error::compiler(U"invalid redefinition of function '"
+                + std::stou32(f.getName().str()) + U"'");
+        names.push_back(f.getName().str());
+    }
+
+    // the functions defined by it are the ones that were not defined before
+    // (local ones may be renamed while linking)
+    std::set<llvm::Function*> defined;
+    for (auto& f : *mod)
+        if (!f.isDeclaration()) defined.insert(&f);
+
+    if (llvm::Linker::linkModules(*mod, std::move(m)))
+        Error::compiler(U"unable to link '" + form + U"' expression");
+
+    for (auto& name : names) {
+        // callers inlining it have to be compiled again if it changes
+        addSignature(name, mod->getFunction(name)->getFunctionType(), 0, src);
+    }
+
+    std::vector<llvm::Function*> fns;
+    for (auto& f : *mod)
+        if (!f.isDeclaration() && !defined.count(&f)) fns.push_back(&f);
+    return fns;
+}
+
+std::vector<llvm::Function*> Compiler::Context::linkIR(const std::string& ir) {
+    llvm::SMDiagnostic err;
+    auto m = llvm::parseAssemblyString(ir, err, mod->getContext());
+    if (!m) {
+        Error::compiler(U"invalid llvm ir in 'native-llvm' expression (line "
+            + std::stou32(std::to_string(err.getLineNo())) + U", column "
+            + std::stou32(std::to_string(err.getColumnNo() + 1)) + U"): "
+            + std::stou32(err.getMessage().str()));
+    }
+
+    return linkNative(std::move(m), ir, U"native-llvm");
+}
+
+std::vector<llvm::Function*> Compiler::Context::linkC(const std::string& code) {
+    std::string src = tempfile(".c"), bc = tempfile(".bc");
+    {
+        std::ofstream out(src);
+        out << code;
+    }
+
+    // the ir is optimized with the module (i.e. after inlining it into the
+    // callers), c99 'inline' functions are emitted like 'extern inline' ones
+    std::vector<llvm::StringRef> args = { opts.clang, "-x", "c", "-std=gnu11",
+        "-fgnu89-inline", "-O2", "-Xclang", "-disable-llvm-passes",
+        "-emit-llvm", "-c", "-target", mod->getTargetTriple() };
+    if (dib) args.push_back("-g");
+    args.insert(args.end(), { src, "-o", bc });
+
+    // run without a shell, paths are passed as they are
+    auto clang = llvm::sys::findProgramByName(opts.clang);
+    int result = clang ? llvm::sys::ExecuteAndWait(*clang, args) : -1;
+    std::remove(src.c_str());
+
+    if (result) {
+        std::remove(bc.c_str());
+        Error::compiler(U"unable to compile 'native-c' expression with '"
+            + std::stou32(opts.clang) + U"'");
+    }
+
+    llvm::SMDiagnostic err;
+    auto m = llvm::parseIRFile(bc, err, mod->getContext());
+    std::remove(bc.c_str());
+    if (!m) {
+        Error::compiler(U"cannot read the llvm ir of 'native-c' expression (is '"
+            + std::stou32(opts.clang) + U"' a clang for llvm "
+            + std::stou32(LLVM_VERSION_STRING) + U" or older?): "
+            + std::stou32(err.getMessage().str()));
+    }
+
+    auto fns = linkNative(std::move(m), code, U"native-c");
+    for (auto f : fns) {
+        // code generated for the target of the module instead of the cpu
+        // clang defaults to
+        f->removeFnAttr("target-cpu");
+        f->removeFnAttr("target-features");
+        f->removeFnAttr("tune-cpu");
+
+        // 'inline' functions are inlined into Adscript callers, like ^inline
+        // ones
+        if (f->hasFnAttribute(llvm::Attribute::InlineHint))
+            f->addFnAttr(llvm::Attribute::AlwaysInline);
+    }
+    for (auto f : fns) runFPM(f);
+
+    return fns;
+}
+
+llvm::Value* Compiler::Context::getSyncFrame() {
+    if (syncFrame) return syncFrame;
+
+    // the runtime's '{ pending, started }', zeroed on entry
+    auto frameT = llvm::ArrayType::get(
+        llvm::Type::getInt64Ty(mod->getContext()), 2);
+    auto frame = createAlloca(builder->GetInsertBlock()->getParent(), frameT);
+    llvm::IRBuilder<> entry(frame->getParent(), ++frame->getIterator());
+    entry.CreateStore(llvm::Constant::getNullValue(frameT), frame);
+
+    return syncFrame = frame;
+}
+
+void Compiler::Context::syncSpawns() {
+    if (!syncFrame) return;
+
+    auto sync = mod->getOrInsertFunction("adscript_sync",
+        llvm::Type::getVoidTy(mod->getContext()), syncFrame->getType());
+    builder->CreateCall(sync, { syncFrame });
+}
+
+void Compiler::Context::inlineLocalCalls(llvm::Function *f) {
+    std::set<llvm::Function*> callees;
+    for (auto& bb : *f) {
+        for (auto& inst : bb) {
+            auto call = llvm::dyn_cast<llvm::CallBase>(&inst);
+            auto callee = call ? call->getCalledFunction() : nullptr;
+            if (callee && callee->hasLocalLinkage()
+                    && callee->getInstructionCount() <= specializeBudget)
+                callees.insert(callee);
+        }
+    }
+    inlineCalls(f, callees);
+}
+
 void Compiler::Context::runFPM(llvm::Function *f) {
     if (!f) return;
+
+    // sample profiles tell apart code on the same line by discriminators
+    if (dib) llvm::AddDiscriminatorsPass().run(*f, fam);
+
+    // profiles have to be instrumented/applied before optimizing anything
+    if (usesPGO()) {
+        deferred.push_back(f);
+        return;
+    }
+
+    Trace::Scope scope("Optimize", f->hasName() ? f->getName().str() : "lambda");
+    inlineCalls(f);
     fpm.run(*f, fam);
+
+    // coroutines with their frame on the stack are resumed by direct calls now
+    if (inlineCalls(f)) {
+        fam.invalidate(*f, llvm::PreservedAnalyses::none());
+        fpm.run(*f, fam);
+    }
+}
+
+void Compiler::Context::optimize() {
+    if (dib) dib->finalize();
+
+    // the coroutine intrinsics left (i.e. in functions creating coroutines
+    // that are not inlined) are lowered once everything is inlined
+    llvm::FunctionPassManager coroFPM;
+    coroFPM.addPass(llvm::CoroEarlyPass());
+    coroFPM.addPass(llvm::CoroCleanupPass());
+    for (auto& f : *mod) {
+        if (!f.isDeclaration()) coroFPM.run(f, fam);
+    }
+
+    if (!usesPGO()) return;
+
+    llvm::ModulePassManager mpm;
+
+    if (opts.profileGenerate)
+        mpm.addPass(llvm::PGOInstrumentationGen());
+
+    if (!opts.profileUse.empty()) {
+        if (!llvm::sys::fs::exists(opts.profileUse))
+            Error::compiler(U"cannot read profile '"
+                + std::stou32(opts.profileUse) + U"'");
+        mpm.addPass(llvm::PGOInstrumentationUse(opts.profileUse));
+    }
+
+    if (!opts.profileSampleUse.empty()) {
+        if (!llvm::sys::fs::exists(opts.profileSampleUse))
+            Error::compiler(U"cannot read profile '"
+                + std::stou32(opts.profileSampleUse) + U"'");
+        for (auto& f : *mod) {
+            if (!f.isDeclaration()) f.addFnAttr("use-sample-profile");
+        }
+        mpm.addPass(llvm::SampleProfileLoaderPass(opts.profileSampleUse));
+    }
+
+    {
+        Trace::Scope scope("PGO", mod->getName().str());
+        mpm.run(*mod, mam);
+    }
+
+    for (auto f : deferred) {
+        Trace::Scope scope("Optimize", f->getName().str());
+        inlineCalls(f);
+        fpm.run(*f, fam);
+    }
+    deferred.clear();
+
+    // lower the instrumentation intrinsics to counters and profile data that
+    // the profile runtime writes out at exit
+    if (opts.profileGenerate) {
+        llvm::InstrProfOptions options;
+        options.InstrProfileOutput = opts.profileOutput;
+
+        llvm::ModulePassManager lowering;
+        lowering.addPass(llvm::InstrProfiling(options));
+        lowering.run(*mod, mam);
+    }
+}
+
+void Compiler::Context::instrumentFunctions() {
+    auto& c = mod->getContext();
+    auto i8PtrT = llvm::Type::getInt8PtrTy(c);
+    auto i64T = llvm::Type::getInt64Ty(c);
+
+    std::vector<llvm::Constant*> fns, names;
+    for (auto& f : *mod) {
+        // lambdas that were inlined everywhere
+        if (f.isDeclaration() || (f.hasLocalLinkage() && f.use_empty()))
+            continue;
+
+        f.addFnAttr("instrument-function-entry-inlined", "__cyg_profile_func_enter");
+        f.addFnAttr("instrument-function-exit-inlined", "__cyg_profile_func_exit");
+        llvm::EntryExitInstrumenterPass(true).run(f, fam);
+
+        fns.push_back(llvm::ConstantExpr::getPointerCast(&f, i8PtrT));
+        auto name = llvm::ConstantDataArray::getString(c, f.getName());
+        auto nameV = new llvm::GlobalVariable(*mod, name->getType(), true,
+            llvm::GlobalValue::PrivateLinkage, name, "instrument.name");
+        names.push_back(llvm::ConstantExpr::getPointerCast(nameV, i8PtrT));
+    }
+
+    if (fns.empty()) return;
+
+    auto arrayT = llvm::ArrayType::get(i8PtrT, fns.size());
+    auto fnsV = new llvm::GlobalVariable(*mod, arrayT, true,
+        llvm::GlobalValue::PrivateLinkage, llvm::ConstantArray::get(arrayT, fns),
+        "instrument.fns");
+    auto namesV = new llvm::GlobalVariable(*mod, arrayT, true,
+        llvm::GlobalValue::PrivateLinkage, llvm::ConstantArray::get(arrayT, names),
+        "instrument.names");
+
+    // registers the names when the program starts
+    auto ctor = llvm::Function::Create(
+        llvm::FunctionType::get(llvm::Type::getVoidTy(c), false),
+        llvm::Function::InternalLinkage, "adscript.instrument", mod);
+    llvm::IRBuilder<> b(llvm::BasicBlock::Create(c, "", ctor));
+    auto reg = mod->getOrInsertFunction("adscript_instrument_register", i64T,
+        i8PtrT->getPointerTo(), i8PtrT->getPointerTo(), i64T);
+    b.CreateCall(reg, {
+        b.CreatePointerCast(fnsV, i8PtrT->getPointerTo()),
+        b.CreatePointerCast(namesV, i8PtrT->getPointerTo()),
+        llvm::ConstantInt::get(i64T, fns.size()),
+    });
+    b.CreateRetVoid();
+
+    llvm::appendToGlobalCtors(*mod, ctor, 0);
+}
+
+// bump this whenever the cached IR of a function may change for the same
+// source, i.e. when codegen or the optimization pipeline change
+static const char *cacheVersion = "adscript-fncache-3";
+
+void Compiler::Context::addSignature(const std::string& id, llvm::Type *t, unsigned attrs,
+                                     const std::string& body) {
+    // callers are optimized differently depending on the callee's attributes
+    auto sig = std::to_string(Compiler::llvmTypeStr(t))
+        + (attrs ? " ^" + std::to_string(attrs) : "");
+
+    // named structs are printed as their name only
+    if (auto st = llvm::dyn_cast<llvm::StructType>(t)) {
+        sig += st->isPacked() ? " <{" : " {";
+        for (size_t i = 0; i < st->getNumElements(); i++) {
+            auto& fields = structs[st].fields;
+            sig += " " + std::to_string(Compiler::llvmTypeStr(st->getElementType(i)))
+                + " " + (i < fields.size() ? fields[i] : "");
+        }
+        sig += " } " + std::to_string(structs[st].align);
+    }
+
+    if (!body.empty()) sig += " " + body;
+
+    signatures[id] = sig;
+}
+
+void Compiler::Context::addGeneric(const std::string& id, AST::Function *f,
+                                   const std::u32string& src) {
+    generics[id] = f;
+    // callers depend on the code of the instances they use
+    signatures[id] = "generic " + std::to_string(src);
+}
+
+std::string Compiler::Context::cacheKey(const std::u32string& src) {
+    // optimized ir depends on the profile when using pgo, debug info on the
+    // position of the function in its file
+    if (opts.cacheDir.empty() || src.empty() || usesPGO() || dib) return "";
+
+    // collect every word of the form that names a known function or type, so
+    // the key only changes if something the form depends on changes
+    std::set<std::string> deps;
+    std::string word;
+    for (auto c : src) {
+        bool sep = c < 128 && (Utils::isWhitespace(c) || Utils::isSpecialChar(c)
+                                || c == '\'' || c == '"');
+        if (!sep) {
+            word += std::to_string(std::u32string(1, c));
+            continue;
+        }
+        if (signatures.find(word) != signatures.end()) deps.insert(word);
+        word.clear();
+    }
+    if (signatures.find(word) != signatures.end()) deps.insert(word);
+
+    llvm::MD5 md5;
+    md5.update(cacheVersion);
+    md5.update(LLVM_VERSION_STRING);
+    // the ir is optimized for the target
+    md5.update(mod->getTargetTriple());
+    md5.update(mod->getDataLayoutStr());
+    md5.update(std::to_string(src));
+    for (auto& dep : deps) {
+        md5.update(dep);
+        md5.update(signatures[dep]);
+    }
+
+    llvm::MD5::MD5Result result;
+    md5.final(result);
+    return result.digest().str().str();
+}
+
+static std::string cachePath(const std::string& dir, const std::string& key) {
+    llvm::SmallString<128> path(dir);
+    llvm::sys::path::append(path, key + ".bc");
+    return path.str().str();
+}
+
+llvm::Function* Compiler::Context::loadCached(llvm::Function *f, const std::string& key) {
+    if (key.empty()) return nullptr;
+
+    auto buf = llvm::MemoryBuffer::getFile(cachePath(opts.cacheDir, key));
+    if (!buf) return nullptr;
+
+    auto cached = llvm::parseBitcodeFile((*buf)->getMemBufferRef(), mod->getContext());
+    if (!cached) {
+        llvm::consumeError(cached.takeError());
+        return nullptr;
+    }
+
+    auto cf = (*cached)->getFunction(f->getName());
+    if (!cf || cf->isDeclaration() || cf->getFunctionType() != f->getFunctionType())
+        return nullptr;
+
+    std::string id = f->getName().str();
+
+    // the linker replaces the declaration 'f' with the cached definition
+    if (llvm::Linker::linkModules(*mod, std::move(*cached)))
+        Error::compiler(U"unable to link cached function '" + std::stou32(id) + U"'");
+
+    return mod->getFunction(id);
+}
+
+// collects 'v' and every module-local global value (lambdas, string literals,
+// arrays) and instance of a generic function it references
+static void collectDeps(const llvm::Value *v, std::set<const llvm::GlobalValue*>& deps) {
+    if (auto gv = llvm::dyn_cast<llvm::GlobalValue>(v)) {
+        if (!deps.empty() && !gv->hasLocalLinkage() && !gv->hasLinkOnceODRLinkage())
+            return;
+        if (!deps.insert(gv).second) return;
+
+        if (auto f = llvm::dyn_cast<llvm::Function>(gv)) {
+            for (auto& bb : *f)
+                for (auto& inst : bb)
+                    for (auto& op : inst.operands()) collectDeps(op, deps);
+        } else if (auto g = llvm::dyn_cast<llvm::GlobalVariable>(gv)) {
+            if (g->hasInitializer()) collectDeps(g->getInitializer(), deps);
+        }
+    } else if (auto c = llvm::dyn_cast<llvm::Constant>(v)) {
+        for (auto& op : c->operands()) collectDeps(op, deps);
+    }
+}
+
+void Compiler::Context::storeCached(llvm::Function *f, const std::string& key) {
+    if (key.empty()) return;
+
+    std::set<const llvm::GlobalValue*> deps;
+    collectDeps(f, deps);
+
+    llvm::ValueToValueMapTy vmap;
+    auto m = llvm::CloneModule(*mod, vmap, [&](const llvm::GlobalValue *gv) {
+        return deps.find(gv) != deps.end();
+    });
+
+    // everything 'f' does not depend on has become an unused declaration
+    for (auto& g : llvm::make_early_inc_range(m->functions()))
+        if (g.isDeclaration() && g.use_empty()) g.eraseFromParent();
+    for (auto& g : llvm::make_early_inc_range(m->globals()))
+        if (g.isDeclaration() && g.use_empty()) g.eraseFromParent();
+
+    // write to a temporary file first, so concurrent builds never read a
+    // partially written cache entry
+    std::string path = cachePath(opts.cacheDir, key);
+    llvm::SmallString<128> tmp;
+    int fd;
+    if (llvm::sys::fs::createUniqueFile(path + "-%%%%%%.tmp", fd, tmp)) {
+        Error::warning(U"cannot write to function cache '"
+            + std::stou32(opts.cacheDir) + U"'");
+        return;
+    }
+
+    {
+        llvm::raw_fd_ostream os(fd, true);
+        llvm::WriteBitcodeToFile(*m, os);
+    }
+
+    if (llvm::sys::fs::rename(tmp, path))
+        llvm::sys::fs::remove(tmp);
 }
 
 std::string getFileName(const std::string& path) {
@@ -83,28 +1141,32 @@ std::string getModuleId(const std::string& filename) {
         : filename;
 }
 
-void compileModuleToFile(llvm::Module *mod, const std::string &output, const std::string &target) {
+llvm::TargetMachine* Compiler::createTargetMachine(const std::string &target) {
     llvm::InitializeAllTargetInfos();
     llvm::InitializeAllTargets();
     llvm::InitializeAllTargetMCs();
     llvm::InitializeAllAsmParsers();
     llvm::InitializeAllAsmPrinters();
 
-    mod->setTargetTriple(target);
-
     std::string err;
     const llvm::Target *t =
         llvm::TargetRegistry::lookupTarget(target, err);
 
     if (!t) Error::compiler(std::stou32(err));
 
-    llvm::TargetMachine *targetMachine = t->createTargetMachine(
+    return t->createTargetMachine(
         target,
         "", "",
         llvm::TargetOptions(),
         // TODO: make configurable
         llvm::Reloc::PIC_
     );
+}
+
+void Compiler::compileModuleToFile(llvm::Module *mod, const std::string &output, const std::string &target) {
+    mod->setTargetTriple(target);
+
+    llvm::TargetMachine *targetMachine = createTargetMachine(target);
 
     mod->setDataLayout(targetMachine->createDataLayout());
 
@@ -130,8 +1192,27 @@ void compileModuleToFile(llvm::Module *mod, const std::string &output, const std
     dest.flush();
 }
 
-void link(const std::string &obj, const std::string &exe) {
-    int linkResult = system(("cc " + obj + " -o " + exe).c_str());
+// declarations of the runtime library, generated from runtime/prelude.adscript
+static const char *prelude =
+#include "prelude.inc"
+;
+
+// whether 'mod' calls into the runtime library (libadscript-rt)
+bool usesRuntime(llvm::Module &mod) {
+    for (auto& f : mod.functions()) {
+        if (f.isDeclaration() && f.getName().startswith("adscript_"))
+            return true;
+    }
+    return false;
+}
+
+void link(const std::string &obj, const std::string &exe, const Compiler::Options &opts,
+          bool runtime) {
+    // links the profile runtime, this needs cc to be clang
+    std::string flags = opts.profileGenerate ? " -fprofile-instr-generate" : "";
+    if (runtime) flags += " -ladscript-rt -lpthread";
+
+    int linkResult = system(("cc " + obj + " -o " + exe + flags).c_str());
 
     if (linkResult)
         Error::compiler(std::stou32("error while linking '" + exe + "'"));
@@ -140,26 +1221,145 @@ void link(const std::string &obj, const std::string &exe) {
         Error::def(std::stou32("cannot remove '" + obj + "'"));
 }
 
-std::string tempfile() {
-    char file[] = "/tmp/adscript-XXXXXXXX.o";
-    mkstemp(file);
-    return file;
-}
+// prints the optimization remarks of the passes matching the -Rpass options
+// at the position in the source code they are about, like clang
+class RemarkHandler : public llvm::DiagnosticHandler {
+private:
+    std::unique_ptr<llvm::Regex> passed, missed, analysis;
+
+    static std::unique_ptr<llvm::Regex> regex(const std::string& pattern,
+            const std::string& option) {
+        if (pattern.empty()) return nullptr;
+
+        auto r = std::make_unique<llvm::Regex>(pattern);
+        std::string err;
+        if (!r->isValid(err))
+            Error::compiler(U"invalid regex for " + std::stou32(option) + U": "
+                + std::stou32(err));
+        return r;
+    }
+
+    static bool matches(const std::unique_ptr<llvm::Regex>& r,
+            llvm::StringRef pass) {
+        return r && r->match(pass);
+    }
+
+public:
+    RemarkHandler(const Compiler::Options &opts)
+        : passed(regex(opts.remarksPassed, "-Rpass")),
+          missed(regex(opts.remarksMissed, "-Rpass-missed")),
+          analysis(regex(opts.remarksAnalysis, "-Rpass-analysis")) {}
+
+    bool isPassedOptRemarkEnabled(llvm::StringRef pass) const override {
+        return matches(passed, pass);
+    }
+    bool isMissedOptRemarkEnabled(llvm::StringRef pass) const override {
+        return matches(missed, pass);
+    }
+    bool isAnalysisRemarkEnabled(llvm::StringRef pass) const override {
+        return matches(analysis, pass);
+    }
+    bool isAnyRemarkEnabled() const override {
+        return passed || missed || analysis;
+    }
+
+    bool handleDiagnostics(const llvm::DiagnosticInfo &di) override {
+        auto remark = llvm::dyn_cast<llvm::DiagnosticInfoOptimizationBase>(&di);
+        if (!remark) return false;
+        if (!remark->isEnabled()) return true;
+
+        std::string option;
+        switch (remark->getKind()) {
+        case llvm::DK_OptimizationRemark:
+        case llvm::DK_MachineOptimizationRemark:
+            option = "-Rpass"; break;
+        case llvm::DK_OptimizationRemarkMissed:
+        case llvm::DK_MachineOptimizationRemarkMissed:
+            option = "-Rpass-missed"; break;
+        default:
+            option = "-Rpass-analysis"; break;
+        }
+
+        auto& out = llvm::errs();
+        auto loc = remark->getLocation();
+        if (loc.isValid())
+            out << loc.getRelativePath() << ":" << loc.getLine() << ":"
+                << loc.getColumn() << ": ";
+        else
+            out << remark->getFunction().getName() << ": ";
+
+        llvm::WithColor::remark(out) << remark->getMsg();
+        if (auto hotness = remark->getHotness())
+            out << " (hotness: " << *hotness << ")";
+        out << " [" << option << "=" << remark->getPassName() << "]\n";
+        return true;
+    }
+};
+
+void Compiler::compile(std::vector<AST::Expr*>& exprs, const std::string &output, const Options &opts) {
+    Trace::Scope scope("Compile", output);
 
-void Compiler::compile(std::vector<AST::Expr*>& exprs, bool exe, const std::string &output, const std::string &target, bool emitLLVM) {
     std::string filename = getFileName(output);
     std::string moduleId = getModuleId(filename);
 
+    if (!opts.cacheDir.empty() && llvm::sys::fs::create_directories(opts.cacheDir))
+        Error::compiler(U"cannot create cache directory '"
+            + std::stou32(opts.cacheDir) + U"'");
+
     llvm::LLVMContext ctx;
     llvm::Module mod(moduleId, ctx);
     llvm::IRBuilder<> builder(ctx);
 
-    Compiler::Context cctx(&mod, &builder);
+    // remarks are emitted by the passes while the functions are optimized
+    ctx.setDiagnosticHandler(std::make_unique<RemarkHandler>(opts));
+    ctx.setDiagnosticsHotnessRequested(!opts.profileUse.empty()
+        || !opts.profileSampleUse.empty());
+
+    std::unique_ptr<llvm::ToolOutputFile> remarksFile;
+    if (!opts.remarksFile.empty()) {
+        auto file = llvm::setupLLVMOptimizationRemarks(ctx, opts.remarksFile,
+            "", "yaml", ctx.getDiagnosticsHotnessRequested());
+        if (!file)
+            Error::compiler(U"cannot write remarks to '"
+                + std::stou32(opts.remarksFile) + U"': "
+                + std::stou32(llvm::toString(file.takeError())));
+        remarksFile = std::move(*file);
+    }
+
+    // instrumentation passes depend on the target triple
+    mod.setTargetTriple(opts.target);
+
+    Compiler::Context cctx(&mod, &builder, opts);
+
+    Trace::begin("Prelude", moduleId);
+    Lexer lexer(std::stou32(prelude));
+    auto preludeExprs = Parser(lexer, "prelude").parse();
+    for (auto& expr : preludeExprs) {
+        expr->llvmValue(cctx);
+        delete expr;
+    }
+    Trace::end();
+
+    Trace::begin("Codegen", moduleId);
     for (auto& expr : exprs) expr->llvmValue(cctx);
+    Trace::end();
+
+    // declarations of the prelude the module does not use
+    for (auto it = mod.begin(); it != mod.end();) {
+        auto& f = *it++;
+        if (f.isDeclaration() && f.use_empty() && f.getName().startswith("adscript_"))
+            f.eraseFromParent();
+    }
+
+    cctx.optimize();
+
+    if (opts.instrumentFunctions) cctx.instrumentFunctions();
 
     cctx.clear();
 
-    if (emitLLVM) {
+    if (opts.emitLLVM) {
+        Trace::Scope scope("EmitLLVM", moduleId);
+
         auto idx = output.find_last_of("/\\");
         std::string fname;
 
@@ -174,7 +1374,16 @@ void Compiler::compile(std::vector<AST::Expr*>& exprs, bool exe, const std::stri
         mod.print(dest, 0);
     }
 
-    std::string obj = exe ? tempfile() : output;
-    compileModuleToFile(&mod, obj, target);
-    if (exe) link(obj, output);
+    std::string obj = opts.exe ? tempfile() : output;
+
+    Trace::begin("EmitObject", obj);
+    compileModuleToFile(&mod, obj, opts.target);
+    Trace::end();
+
+    if (remarksFile) remarksFile->keep();
+
+    if (opts.exe) {
+        Trace::Scope scope("Link", output);
+        link(obj, output, opts, usesRuntime(mod));
+    }
 }
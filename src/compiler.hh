@@ -2,10 +2,14 @@
 
 #include "ast.hh"
 
+#include <set>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include <llvm/ADT/Hashing.h>
+#include <llvm/IR/DIBuilder.h>
+#include <llvm/Target/TargetMachine.h>
 #include <llvm/Passes/PassBuilder.h>
 
 namespace Adscript {
@@ -14,36 +18,224 @@ namespace Compiler {
 typedef std::pair<llvm::Type*, llvm::Value*> ctx_var_t;
 typedef std::map<std::string, ctx_var_t> scope;
 
+struct Options {
+    bool exe = false;
+    bool emitLLVM = false;
+    std::string target;
+
+    // directory optimized function IR is cached in between runs (disabled if
+    // empty)
+    std::string cacheDir;
+
+    // instrument the module to write a raw profile to 'profileOutput' when it
+    // is run
+    bool profileGenerate = false;
+    std::string profileOutput = "default.profraw";
+
+    // indexed profile (llvm-profdata merge) to annotate the module with before
+    // it is optimized
+    std::string profileUse;
+
+    // sample profile (i.e. from perf data) to annotate the module with before
+    // it is optimized, needs debug info
+    std::string profileSampleUse;
+
+    // emit debug line tables
+    bool debugInfo = false;
+
+    // compiles 'native-c' expressions to llvm ir
+    std::string clang = "clang";
+
+    // count the calls of every function and the time spent in it, written
+    // out at exit by the runtime library
+    bool instrumentFunctions = false;
+
+    // regexes of the passes whose optimization remarks (optimizations that
+    // were done, that were missed and analyses of why) are printed, they are
+    // positioned by the debug info
+    std::string remarksPassed, remarksMissed, remarksAnalysis;
+    // yaml file all remarks are written to
+    std::string remarksFile;
+};
+
 class Context {
 private:
+    // target the module is optimized for
+    std::unique_ptr<llvm::TargetMachine> tm;
+
+    llvm::PassInstrumentationCallbacks pic;
+
     llvm::ModuleAnalysisManager     mam;
     llvm::CGSCCAnalysisManager      gam;
     llvm::FunctionAnalysisManager   fam;
     llvm::LoopAnalysisManager       lam;
     llvm::FunctionPassManager       fpm;     
+
+    // signatures of all functions and types defined so far, used to
+    // fingerprint top-level forms for the function cache
+    std::map<std::string, std::string> signatures;
+
+    // functions whose optimization is deferred until the whole module is
+    // generated
+    std::vector<llvm::Function*> deferred;
+
+    bool usesPGO() {
+        return opts.profileGenerate || !opts.profileUse.empty()
+            || !opts.profileSampleUse.empty();
+    }
+
+    // only set up if debug info is emitted
+    std::unique_ptr<llvm::DIBuilder> dib;
+    llvm::DICompileUnit *diCU = nullptr;
+    std::map<std::string, llvm::DIFile*> diFiles;
+
+    llvm::DIFile* getDIFile(const std::string& path);
+
+    // inlines the calls in 'f' to functions marked ^inline and to 'callees',
+    // returns whether there were any
+    bool inlineCalls(llvm::Function *f,
+                     const std::set<llvm::Function*>& callees = {});
+
+    // clones of functions specialized for the functions passed to them
+    std::map<std::pair<llvm::Function*, std::vector<llvm::Function*>>,
+             llvm::Function*> specializations;
+
+    // type-based alias analysis nodes of the types loaded and stored
+    llvm::MDNode *tbaaRoot = nullptr;
+    std::map<llvm::Type*, llvm::MDNode*> tbaaTags;
+
+    llvm::MDNode* tbaaTag(llvm::Type *t);
+
+    // links module 'm' of the 'native-llvm' or 'native-c' expression 'form'
+    // with the code 'src', returns the functions defined by it
+    std::vector<llvm::Function*> linkNative(std::unique_ptr<llvm::Module> m,
+        const std::string& src, const std::u32string& form);
+
+    // handle types of coroutines by the type they yield and return, and the
+    // other way around
+    std::map<llvm::Type*, llvm::PointerType*> asyncTypes;
+    std::map<llvm::Type*, llvm::Type*> asyncValues;
+
+    // makes 'id' a variable of the function at nesting level 'level' (the
+    // outermost function being 0) by capturing it from the function the
+    // lambda at that level is nested in
+    bool capture(const std::string& id, size_t level);
 public:
     llvm::Module *mod;
     llvm::IRBuilder<> *builder;
+    const Options &opts;
     scope varScope;
     scope finalScope;
     std::map<std::string, llvm::Type*> types;
 
     bool needsRef = false;
 
-    Context(llvm::Module *mod, llvm::IRBuilder<> *builder) : mod(mod), builder(builder) {
-        llvm::PassBuilder passBuilder;
+    // field names and explicit alignment ('^align(N)') of struct types
+    struct StructInfo {
+        std::vector<std::string> fields;
+        unsigned align = 0;
+    };
+    std::map<llvm::StructType*, StructInfo> structs;
+    // element struct types of soa collection types
+    std::map<llvm::StructType*, llvm::StructType*> soas;
 
-        passBuilder.registerModuleAnalyses   (mam);
-        passBuilder.registerCGSCCAnalyses    (gam);
-        passBuilder.registerFunctionAnalyses (fam);
-        passBuilder.registerLoopAnalyses     (lam);
+    // index of 'field' in 't', -1 if there is no such field
+    int fieldIndex(llvm::StructType *t, const std::string& field);
+    // alignment of 't' in memory, including explicit struct alignment
+    unsigned getAlign(llvm::Type *t);
 
-        passBuilder.crossRegisterProxies(lam, fam, gam, mam);
+    // a heterogeneous array, the tuple holding its elements and the stores
+    // of the pointers to them into the array
+    struct HeTuple {
+        llvm::AllocaInst *array, *tuple;
+        std::vector<llvm::StoreInst*> init;
+    };
+    // tuples of heterogeneous arrays, by the array or the variable it is
+    // stored in
+    std::map<llvm::Value*, std::shared_ptr<HeTuple>> heTuples;
+    // loads of the pointers to elements at constant indices and the pointers
+    // into the tuple they are replaced with if the array is never written to
+    struct HeLoad {
+        std::shared_ptr<HeTuple> tuple;
+        llvm::LoadInst *load;
+        llvm::Value *elem;
+    };
+    std::vector<HeLoad> heLoads;
+    // replaces the loads in 'f' from arrays that are never written to, once
+    // 'f' is generated
+    void forwardHeLoads(llvm::Function *f);
 
-        fpm = passBuilder.buildFunctionSimplificationPipeline(
-            llvm::PassBuilder::OptimizationLevel::O3,
-            llvm::ThinOrFullLTOPhase::None);
-    }
+    // lambdas that are generated at the moment, innermost last
+    struct Closure {
+        llvm::Function *f;
+        // variables of the function the lambda is nested in
+        scope outer;
+        // captured variables of that function and their copies in the lambda
+        std::vector<std::pair<ctx_var_t, llvm::Value*>> captures;
+        // captured variables are used through pointers to them instead (the
+        // environment is an array of them), only for code that runs before
+        // the function creating it returns
+        bool byRef = false;
+    };
+    std::vector<Closure> closures;
+
+    // environments of the closures created in functions that are generated
+    // at the moment and the instructions creating them
+    std::vector<std::pair<llvm::AllocaInst*, llvm::Instruction*>> closureEnvs;
+
+    // counter of the tasks spawned by the function that is generated at the
+    // moment ('adscript_sync' waits for them), if it spawns any
+    llvm::Value *syncFrame = nullptr;
+
+    // returns the counter of spawned tasks, creating it if needed
+    llvm::Value* getSyncFrame();
+    // waits for the tasks spawned so far by the current function
+    void syncSpawns();
+
+    // the coroutine ('^async' function) that is generated at the moment
+    struct Coroutine {
+        llvm::Value *id;
+        llvm::Value *handle;
+        llvm::AllocaInst *promise;
+        // allocates the frame (if it is not put on the stack of the caller)
+        llvm::CallInst *alloc;
+        // frees the frame when the coroutine is destroyed
+        llvm::BasicBlock *cleanup;
+        // returns to the caller or resumer
+        llvm::BasicBlock *suspend;
+    };
+    Coroutine *coroutine = nullptr;
+
+    // the handle type of coroutines yielding and returning 't'
+    llvm::PointerType* getAsyncType(llvm::Type *t);
+    // the type a coroutine with the handle type 't' yields and returns,
+    // nullptr if 't' is no handle type
+    llvm::Type* asyncValueType(llvm::Type *t);
+
+    // suspends the current coroutine, the code generated afterwards runs when
+    // it is resumed (never for the final suspension)
+    void suspend(bool final = false);
+
+    // splits coroutine 'f' into the function creating it (which is inlined
+    // into its callers, so frames not outliving them are put on their stack)
+    // and the functions resuming and destroying it
+    void splitCoroutine(llvm::Function *f);
+
+    // parses the llvm ir 'ir' and links it into the module as it is (without
+    // optimizing it), returns the functions it defines
+    std::vector<llvm::Function*> linkIR(const std::string& ir);
+    // compiles the c code 'code' with clang and links it into the module,
+    // returns the functions it defines (optimized like Adscript functions)
+    std::vector<llvm::Function*> linkC(const std::string& code);
+
+    // generic functions by name
+    std::map<std::string, AST::Function*> generics;
+    void addGeneric(const std::string& id, AST::Function *f, const std::u32string& src);
+
+    // debug info scope of the function that is generated at the moment
+    llvm::DIScope *diScope = nullptr;
+
+    Context(llvm::Module *mod, llvm::IRBuilder<> *builder, const Options &opts);
     
     bool isVar(const std::string& id);
     bool isType(const std::string& id);
@@ -54,7 +246,46 @@ public:
     ctx_var_t getFinal(const std::string& id);
     llvm::Function* getFunction(const std::string& id);
 
+    // attaches type-based alias analysis metadata to a load or store through
+    // a pointer
+    void addTBAA(llvm::Instruction *inst);
+
+    // closure environments are allocated on the stack of the function
+    // creating them, this moves the ones that may outlive 'f' to the heap
+    void placeClosureEnvs(llvm::Function *f);
+
+    // returns a clone of 'f' with the functions statically known to be passed
+    // to it in 'args' called directly (and inlined if they are small), or 'f'
+    llvm::Function* specialize(llvm::Function *f,
+                               const std::vector<llvm::Value*>& args);
+    // number of specialized calls, functions making them are not cached as
+    // their code depends on the code of the functions they call
+    size_t specialized = 0;
+
+    // inlines the calls in 'f' to small lambdas, closures and specializations
+    void inlineLocalCalls(llvm::Function *f);
+
     void runFPM(llvm::Function *f);
+    void optimize();
+    // makes the functions left after optimizing call the hooks of
+    // runtime/instrument.c and registers their names with it
+    void instrumentFunctions();
+
+    // makes 'f' the current debug info scope (if debug info is emitted),
+    // returns the previous scope to pass to endDebugScope
+    llvm::DIScope* beginDebugScope(llvm::Function *f, const std::string& file,
+                                   unsigned line, unsigned col);
+    void endDebugScope(llvm::DIScope *prev);
+    // name of a function generated for code of the function that is generated
+    // at the moment, i.e. 'main.lambda.12' for a lambda at line 12 of 'main'
+    std::string localName(const std::string& kind, unsigned line);
+
+    // 'body' is the source of functions that are inlined into their callers
+    void addSignature(const std::string& id, llvm::Type *t, unsigned attrs = 0,
+                      const std::string& body = "");
+    std::string cacheKey(const std::u32string& src);
+    llvm::Function* loadCached(llvm::Function *f, const std::string& key);
+    void storeCached(llvm::Function *f, const std::string& key);
 
     void clear() {
         mam.clear();
@@ -64,7 +295,21 @@ public:
     }
 };
 
-void compile(std::vector<AST::Expr*>& exprs, bool exe, const std::string &output, const std::string &target, bool emitLLVM);
+// sets the debug location of the code generated while it exists to the
+// location of 'expr'
+class LocScope {
+private:
+    Context &ctx;
+    llvm::DebugLoc prev;
+public:
+    LocScope(Context &ctx, AST::Expr *expr);
+    ~LocScope();
+};
+
+llvm::TargetMachine* createTargetMachine(const std::string &target);
+
+void compileModuleToFile(llvm::Module *mod, const std::string &output, const std::string &target);
+void compile(std::vector<AST::Expr*>& exprs, const std::string &output, const Options &opts);
 
 }
 }
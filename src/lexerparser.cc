@@ -3,6 +3,7 @@
 #include "lexerparser.hh"
 
 #include <iostream>
+#include <algorithm>
 
 using namespace Adscript;
 
@@ -14,7 +15,7 @@ Lexer::Token Lexer::nextT() {
     char c = getc(idx);
 
     // eat up whitespaces
-    while (Utils::isWhitespace((c = getc(idx))) && idx < text.size())
+    while (Utils::isWhitespace((c = getc(idx))) && idx < size())
         idx += 1;
     
     // handle comments
@@ -24,7 +25,7 @@ Lexer::Token Lexer::nextT() {
         }
 
         // eat up until end of line
-        while ((c = getc(idx)) != '\n' && c != '\r' && idx <= text.size())
+        while ((c = getc(idx)) != '\n' && c != '\r' && idx <= size())
             idx += 1;
 
         // eat up end of line
@@ -37,6 +38,8 @@ Lexer::Token Lexer::nextT() {
     // handle end of file
     if (eofReached()) return Token(TT_EOF, U"end of file");
 
+    tokenIdx = idx;
+
     // handle parentheses and brackets
     switch (c) {
     case '(':
@@ -60,6 +63,9 @@ Lexer::Token Lexer::nextT() {
     case '\'':
         idx += 1;
         return Token(TT_QUOTE, U"'");
+    case '`':
+        idx += 1;
+        return Token(TT_BACKQUOTE, U"`");
     }
     
     // helper variable for temporary string storage
@@ -123,7 +129,7 @@ Lexer::Token Lexer::nextT() {
         if (eofReached()) Error::lexerEOF();
 
         bool lastBS = false;
-        while (((c = getc(idx)) != '"' || lastBS) && idx <= text.size()) {
+        while (((c = getc(idx)) != '"' || lastBS) && idx <= size()) {
             tmpStr += c;
             lastBS = !lastBS && c == '\\';
             idx += 1;
@@ -150,7 +156,7 @@ Lexer::Token Lexer::nextT() {
     }
 
     // handle identifiers
-    while (!Utils::isWhitespace((c = getc(idx))) && !Utils::isSpecialChar(c) && idx < text.size()) {
+    while (!Utils::isWhitespace((c = getc(idx))) && !Utils::isSpecialChar(c) && idx < size()) {
         idx += 1;
         tmpStr += c;
     }
@@ -192,12 +198,43 @@ AST::Type* Parser::parseType(Lexer::Token& tmpT) {
         // eat up quote
         tmpT = lexer.nextT();
 
+        bool packed = false;
+        unsigned align = 0;
+
+        // parse struct attributes
+        while (tmpT == Lexer::TT_ID && tmpT.val[0] == '^') {
+            if (tmpT == "^packed") {
+                packed = true;
+            } else if (tmpT == "^align") {
+                tmpT = lexer.nextT();
+                if (tmpT != Lexer::TT_PO)
+                    Error::parserExpected(U"'('", tmpT.val, lexer.pos());
+
+                tmpT = lexer.nextT();
+                if (tmpT != Lexer::TT_INT)
+                    Error::parserExpected(U"alignment", tmpT.val, lexer.pos());
+
+                align = std::stoul(std::to_string(tmpT.val));
+                if (!align || align & (align - 1))
+                    Error::parser(U"alignment must be a power of 2", lexer.pos());
+
+                tmpT = lexer.nextT();
+                if (tmpT != Lexer::TT_PC)
+                    Error::parserExpected(U"')'", tmpT.val, lexer.pos());
+            } else {
+                Error::parserExpected(U"struct attribute", tmpT.val, lexer.pos());
+            }
+
+            // eat up attribute
+            tmpT = lexer.nextT();
+        }
+
         if (tmpT != Lexer::TT_PO)
             Error::parserExpected(U"'('", tmpT.val, lexer.pos());
         
         tmpT = lexer.nextT();
 
-        std::map<std::string, AST::Type*> attrs;
+        std::vector<std::pair<std::string, AST::Type*>> attrs;
 
         while (tmpT != Lexer::TT_PC && tmpT != Lexer::TT_EOF) {
             auto t1 = parseType(tmpT);
@@ -209,11 +246,11 @@ AST::Type* Parser::parseType(Lexer::Token& tmpT) {
             
             auto id = std::to_string(tmpT.val);
 
-            if (attrs.find(id) != attrs.end())
+            if (Utils::pairVectorKeyExists(attrs, id))
                 Error::parserExpected(
                     U"unique attribute identifier", tmpT.val, lexer.pos());
             
-            attrs[id] = t1;
+            attrs.push_back({ id, t1 });
 
             tmpT = lexer.nextT();
         }
@@ -223,7 +260,56 @@ AST::Type* Parser::parseType(Lexer::Token& tmpT) {
 
         //tmpT = lexer.nextT();
 
-        t = new AST::StructType(attrs);
+        t = new AST::StructType(attrs, packed, align);
+    } else if (tmpT == Lexer::TT_PO) {
+        // eat up '('
+        tmpT = lexer.nextT();
+
+        if (tmpT == "fn") {
+            // eat up 'fn'
+            tmpT = lexer.nextT();
+
+            if (tmpT != Lexer::TT_BRO)
+                Error::parserExpected(U"'['", tmpT.val, lexer.pos());
+
+            // eat up '['
+            tmpT = lexer.nextT();
+
+            std::vector<AST::Type*> args;
+            while (tmpT != Lexer::TT_EOF && tmpT != Lexer::TT_BRC) {
+                auto t1 = parseType(tmpT);
+                if (!t1) Error::parserExpected(U"data type", tmpT.val, lexer.pos());
+                args.push_back(t1);
+            }
+
+            // eat up ']'
+            tmpT = lexer.nextT();
+
+            auto retType = parseType(tmpT);
+            if (!retType)
+                Error::parserExpected(U"return type", tmpT.val, lexer.pos());
+
+            if (tmpT != Lexer::TT_PC)
+                Error::parserExpected(U"')'", tmpT.val, lexer.pos());
+
+            t = new AST::ClosureType(args, retType);
+        } else {
+            if (tmpT != "soa" && tmpT != "async")
+                Error::parserExpected(U"'soa', 'async' or 'fn'", tmpT.val, lexer.pos());
+            bool async = tmpT == "async";
+
+            // eat up 'soa'/'async'
+            tmpT = lexer.nextT();
+
+            auto t1 = parseType(tmpT);
+            if (!t1) Error::parserExpected(U"data type", tmpT.val, lexer.pos());
+
+            if (tmpT != Lexer::TT_PC)
+                Error::parserExpected(U"')'", tmpT.val, lexer.pos());
+
+            if (async) t = new AST::AsyncType(t1);
+            else t = new AST::SoaType(t1);
+        }
     } else return nullptr;
 
     tmpT = lexer.nextT();
@@ -236,11 +322,43 @@ AST::Type* Parser::parseType(Lexer::Token& tmpT) {
         quantity += 1;
     }
 
-    if (quantity > 0) return new AST::PointerType(t, quantity);
+    bool restrict = false;
+    if (tmpT == "restrict") {
+        if (!quantity)
+            Error::parser(U"restrict qualifier on non-pointer type", lexer.pos());
+        restrict = true;
+
+        // eat up 'restrict'
+        tmpT = lexer.nextT();
+    }
+
+    if (quantity > 0) return new AST::PointerType(t, quantity, restrict);
 
     return t;
 }
 
+// atomic operations and the number of arguments they take
+static const std::map<std::u32string, std::pair<AST::AtomicType, size_t>> atomicOps = {
+    { U"atomic-load", { AST::ATOMIC_LOAD, 1 } },
+    { U"atomic-store", { AST::ATOMIC_STORE, 2 } },
+    { U"atomic-swap", { AST::ATOMIC_SWAP, 2 } },
+    { U"cas", { AST::ATOMIC_CAS, 3 } },
+    { U"fetch-add", { AST::ATOMIC_ADD, 2 } },
+    { U"fetch-sub", { AST::ATOMIC_SUB, 2 } },
+    { U"fetch-and", { AST::ATOMIC_AND, 2 } },
+    { U"fetch-or", { AST::ATOMIC_OR, 2 } },
+    { U"fetch-xor", { AST::ATOMIC_XOR, 2 } },
+    { U"fence", { AST::ATOMIC_FENCE, 0 } },
+};
+
+static const std::map<std::u32string, llvm::AtomicOrdering> atomicOrders = {
+    { U"relaxed", llvm::AtomicOrdering::Monotonic },
+    { U"acquire", llvm::AtomicOrdering::Acquire },
+    { U"release", llvm::AtomicOrdering::Release },
+    { U"acq_rel", llvm::AtomicOrdering::AcquireRelease },
+    { U"seq_cst", llvm::AtomicOrdering::SequentiallyConsistent },
+};
+
 template<class T>
 AST::Expr* parseTExpr1(Parser *p, Lexer::Token& tmpT) {
     // eat up remaining token
@@ -297,10 +415,33 @@ AST::Expr* parseTExpr3(Parser *p, Lexer::Token& tmpT) {
 
 
 AST::Expr* Parser::parseExpr(Lexer::Token& tmpT) {
+    auto loc = lexer.tokenLoc();
+
+    auto expr = parseExprWithoutLoc(tmpT);
+    expr->line = loc.first;
+    expr->col = loc.second;
+
+    return expr;
+}
+
+AST::Expr* Parser::parseExprWithoutLoc(Lexer::Token& tmpT) {
     if (tmpT == Lexer::TT_PO) {
+        // index of the '(' the form starts with
+        size_t start = lexer.getIdx() - 1;
+
         tmpT = lexer.nextT();
         if (tmpT == Lexer::TT_EOF)
             Error::parser(U"unexpected end of file");
+        else if (tmpT == Lexer::TT_ID && macros.count(tmpT.val)) {
+            if (++expansionDepth > 1000)
+                Error::parser(U"macro expansion too deep (does '" + tmpT.val
+                    + U"' expand to itself?)", lexer.pos());
+
+            expandMacro(tmpT, start);
+            auto expr = parseExprWithoutLoc(tmpT);
+            expansionDepth--;
+            return expr;
+        }
         else if (tmpT == Lexer::TT_STAR)
             return parseBinExpr(tmpT, AST::BINEXPR_MUL);
         else if (tmpT == Lexer::TT_ID) {
@@ -407,6 +548,197 @@ AST::Expr* Parser::parseExpr(Lexer::Token& tmpT) {
                 tmpT = lexer.nextT();
 
                 return new AST::HeGet(t, ptr, idx);
+            } else if (tmpT == "get") {
+                // eat up 'get'
+                tmpT = lexer.nextT();
+
+                auto ptr = parseExpr(tmpT);
+
+                // eat up remaining token
+                tmpT = lexer.nextT();
+
+                if (tmpT != Lexer::TT_ID)
+                    Error::parserExpected(U"field identifier", tmpT.val, lexer.pos());
+                auto field = tmpT.val;
+
+                // eat up field
+                tmpT = lexer.nextT();
+
+                return new AST::Get(ptr, std::to_string(field));
+            } else if (tmpT == "soa-size") {
+                // eat up 'soa-size'
+                tmpT = lexer.nextT();
+
+                auto t = parseType(tmpT);
+                if (!t)
+                    Error::parserExpected(U"data type", tmpT.val, lexer.pos());
+
+                auto n = parseExpr(tmpT);
+
+                // eat up remaining token
+                tmpT = lexer.nextT();
+
+                return new AST::SoaSize(t, n);
+            } else if (tmpT == "parallel-for") {
+                // eat up 'parallel-for'
+                tmpT = lexer.nextT();
+
+                if (tmpT != Lexer::TT_ID)
+                    Error::parserExpected(U"identifier", tmpT.val, lexer.pos());
+                auto id = std::to_string(tmpT.val);
+
+                // eat up identifier
+                tmpT = lexer.nextT();
+
+                auto start = parseExpr(tmpT);
+
+                // eat up remaining token
+                tmpT = lexer.nextT();
+
+                auto end = parseExpr(tmpT);
+
+                // eat up remaining token
+                tmpT = lexer.nextT();
+
+                std::vector<AST::Expr*> body;
+                while (tmpT != Lexer::TT_EOF && tmpT != Lexer::TT_PC) {
+                    body.push_back(parseExpr(tmpT));
+
+                    // eat up remaining token
+                    tmpT = lexer.nextT();
+                }
+
+                if (tmpT == Lexer::TT_EOF) Error::parser(U"unexpected end of file");
+
+                return new AST::ParallelFor(id, start, end, body);
+            } else if (tmpT == "pmap") {
+                // eat up 'pmap'
+                tmpT = lexer.nextT();
+
+                std::vector<AST::Expr*> exprs;
+                for (int i = 0; i < 4; i++) {
+                    exprs.push_back(parseExpr(tmpT));
+
+                    // eat up remaining token
+                    tmpT = lexer.nextT();
+                }
+
+                if (tmpT != Lexer::TT_PC)
+                    Error::parserExpected(U"')'", tmpT.val, lexer.pos());
+
+                // (parallel-for i 0 n (set (out i) (f (in i)))), with an index
+                // no identifier can clash with. the function, input and output
+                // are evaluated once before the loop, unless they are lambdas
+                // or identifiers (evaluating them has no side effects, and
+                // lambdas and functions are called directly, then inlined)
+                std::string id = "#pmap";
+                std::vector<std::pair<std::string, AST::Expr*>> vars;
+                auto bind = [&](AST::Expr *expr, const std::string& var) {
+                    if (expr->isLambda() || expr->isIdentifier()) return expr;
+                    vars.push_back({ var, expr });
+                    return (AST::Expr*) new AST::Identifier(var);
+                };
+                auto fn = bind(exprs[0], "#pmap.fn");
+                auto in = new AST::Call(bind(exprs[1], "#pmap.in"),
+                                        { new AST::Identifier(id) });
+                auto out = new AST::Call(bind(exprs[2], "#pmap.out"),
+                                         { new AST::Identifier(id) });
+                std::vector<AST::Expr*> body = {
+                    new AST::Set(out, new AST::Call(fn, { in }))
+                };
+
+                return new AST::ParallelFor(id, new AST::Int(0), exprs[3], body,
+                                            vars);
+            } else if (tmpT == "spawn") {
+                return parseTExpr1<AST::Spawn>(this, tmpT);
+            } else if (tmpT == "sync") {
+                // eat up 'sync'
+                tmpT = lexer.nextT();
+
+                if (tmpT != Lexer::TT_PC)
+                    Error::parserExpected(U"')'", tmpT.val, lexer.pos());
+
+                return new AST::Sync();
+            } else if (tmpT == "while") {
+                // eat up 'while'
+                tmpT = lexer.nextT();
+
+                auto cond = parseExpr(tmpT);
+
+                // eat up remaining token
+                tmpT = lexer.nextT();
+
+                std::vector<AST::Expr*> body;
+                while (tmpT != Lexer::TT_EOF && tmpT != Lexer::TT_PC) {
+                    body.push_back(parseExpr(tmpT));
+
+                    // eat up remaining token
+                    tmpT = lexer.nextT();
+                }
+
+                if (tmpT == Lexer::TT_EOF) Error::parser(U"unexpected end of file");
+
+                return new AST::While(cond, body);
+            } else if (tmpT == "yield") {
+                // eat up 'yield'
+                tmpT = lexer.nextT();
+
+                // the value is optional
+                AST::Expr *val = nullptr;
+                if (tmpT != Lexer::TT_PC) {
+                    val = parseExpr(tmpT);
+
+                    // eat up remaining token
+                    tmpT = lexer.nextT();
+                }
+
+                if (tmpT != Lexer::TT_PC)
+                    Error::parserExpected(U"')'", tmpT.val, lexer.pos());
+
+                return new AST::Yield(val);
+            } else if (tmpT == "await") {
+                return parseTExpr1<AST::Await>(this, tmpT);
+            } else if (Utils::strEq(tmpT.val, {U"resume", U"promise", U"destroy"})) {
+                auto ct = tmpT == "resume" ? AST::CORO_RESUME
+                    : tmpT == "promise" ? AST::CORO_PROMISE
+                    : AST::CORO_DESTROY;
+
+                // eat up 'resume'/'promise'/'destroy'
+                tmpT = lexer.nextT();
+
+                auto handle = parseExpr(tmpT);
+
+                // eat up remaining token
+                tmpT = lexer.nextT();
+
+                return new AST::Coro(ct, handle);
+            } else if (atomicOps.count(tmpT.val)) {
+                return parseAtomic(tmpT);
+            } else if (tmpT == "soa-init") {
+                return parseTExpr3<AST::SoaInit>(this, tmpT);
+            } else if (Utils::strEq(tmpT.val, {U"sizeof", U"alignof", U"offsetof"})) {
+                auto tit = tmpT == "sizeof" ? AST::TYPEINFO_SIZEOF
+                    : tmpT == "alignof" ? AST::TYPEINFO_ALIGNOF
+                    : AST::TYPEINFO_OFFSETOF;
+
+                // eat up 'sizeof'/'alignof'/'offsetof'
+                tmpT = lexer.nextT();
+
+                auto t = parseType(tmpT);
+                if (!t)
+                    Error::parserExpected(U"data type", tmpT.val, lexer.pos());
+
+                if (tit != AST::TYPEINFO_OFFSETOF)
+                    return new AST::TypeInfo(tit, t);
+
+                if (tmpT != Lexer::TT_ID)
+                    Error::parserExpected(U"field identifier", tmpT.val, lexer.pos());
+                auto field = tmpT.val;
+
+                // eat up field
+                tmpT = lexer.nextT();
+
+                return new AST::TypeInfo(tit, t, std::to_string(field));
             }
         }
 
@@ -428,13 +760,30 @@ AST::Expr* Parser::parseExpr(Lexer::Token& tmpT) {
 
 AST::Expr* Parser::parseTopLevelExpr(Lexer::Token& tmpT) {
     if (tmpT == Lexer::TT_PO) {
+        // index of the '(' the form starts with
+        size_t start = lexer.getIdx() - 1;
+        auto loc = lexer.tokenLoc();
+
         tmpT = lexer.nextT();
         if (tmpT == Lexer::TT_EOF)
             Error::parser(U"unexpected end of file");
         else if (tmpT == Lexer::TT_ID) {
-            if (tmpT == "defn")
-                return parseFunction(tmpT);
-            else if (tmpT == "deft") {
+            // the forms macros expand to are parsed after them
+            if (macros.count(tmpT.val)) {
+                expandMacro(tmpT, start);
+                lexer.setIdx(start);
+                return nullptr;
+            } else if (tmpT == "defmacro") {
+                parseMacro(tmpT);
+                return nullptr;
+            } else if (tmpT == "defn") {
+                auto f = parseFunction(tmpT);
+                f->setSrc(lexer.slice(start, lexer.getIdx()));
+                f->file = filename;
+                f->line = loc.first;
+                f->col = loc.second;
+                return f;
+            } else if (tmpT == "deft") {
                 // eat up 'deft'
                 tmpT = lexer.nextT();
 
@@ -453,6 +802,26 @@ AST::Expr* Parser::parseTopLevelExpr(Lexer::Token& tmpT) {
                 if (!type) Error::parserExpected(U"data type", tmpT.val);
 
                 return new AST::Deft(type, std::to_string(id));
+            } else if (tmpT == "native-llvm" || tmpT == "native-c") {
+                bool c = tmpT == "native-c";
+
+                // eat up 'native-llvm'/'native-c'
+                tmpT = lexer.nextT();
+
+                if (tmpT != Lexer::TT_STR)
+                    Error::parserExpected(c ? U"string of c code" : U"string of llvm ir",
+                        tmpT.val, lexer.pos());
+
+                auto code = Utils::unescapeStr(tmpT.val);
+
+                // eat up string
+                tmpT = lexer.nextT();
+
+                if (tmpT != Lexer::TT_PC)
+                    Error::parserExpected(U"')'", tmpT.val, lexer.pos());
+
+                if (c) return new AST::NativeC(code);
+                return new AST::NativeLLVM(code);
             }
             
             Error::parserExpected(U"built-in top-level function call identifier",
@@ -559,6 +928,39 @@ AST::Cast* Parser::parseCast(Lexer::Token& tmpT) {
     return new AST::Cast(type, expr);
 }
 
+AST::Atomic* Parser::parseAtomic(Lexer::Token& tmpT) {
+    auto op = atomicOps.at(tmpT.val);
+
+    // eat up the operation
+    tmpT = lexer.nextT();
+
+    std::vector<AST::Expr*> args;
+    for (size_t i = 0; i < op.second; i++) {
+        args.push_back(parseExpr(tmpT));
+
+        // eat up remaining token
+        tmpT = lexer.nextT();
+    }
+
+    // compare-and-swap takes a second ordering for when it fails
+    size_t maxOrders = op.first == AST::ATOMIC_CAS ? 2 : 1;
+    std::vector<llvm::AtomicOrdering> orders;
+    while (tmpT == Lexer::TT_ID && orders.size() < maxOrders) {
+        auto it = atomicOrders.find(tmpT.val);
+        if (it == atomicOrders.end())
+            Error::parserExpected(U"memory ordering", tmpT.val, lexer.pos());
+        orders.push_back(it->second);
+
+        // eat up memory ordering
+        tmpT = lexer.nextT();
+    }
+
+    if (tmpT != Lexer::TT_PC)
+        Error::parserExpected(U"')'", tmpT.val, lexer.pos());
+
+    return new AST::Atomic(op.first, args, orders);
+}
+
 AST::If* Parser::parseIf(Lexer::Token& tmpT) {
     // eat up 'if'
     tmpT = lexer.nextT();
@@ -585,17 +987,83 @@ AST::Function* Parser::parseFunction(Lexer::Token& tmpT) {
     // eat up 'defn'
     tmpT = lexer.nextT();
 
+    unsigned attrs = 0;
+    parseFnAttrs(tmpT, attrs);
+
     auto id = tmpT.val;
 
-    auto lambda = parseLambda(tmpT);
+    // type parameters of generic functions, '<T U>'
+    std::vector<std::string> typeParams;
+    size_t idx = lexer.getIdx();
+    tmpT = lexer.nextT();
+    if (tmpT == Lexer::TT_ID && tmpT.val[0] == '<') {
+        auto param = tmpT.val.substr(1);
+        for (;;) {
+            bool last = !param.empty() && param.back() == '>';
+            if (last) param.pop_back();
+            if (!param.empty()) {
+                if (std::find(typeParams.begin(), typeParams.end(),
+                        std::to_string(param)) != typeParams.end())
+                    Error::parserExpected(U"unique type parameter", param, lexer.pos());
+                typeParams.push_back(std::to_string(param));
+            }
+            if (last) break;
+
+            // eat up type parameter
+            tmpT = lexer.nextT();
+            if (tmpT != Lexer::TT_ID)
+                Error::parserExpected(U"type parameter or '>'", tmpT.val, lexer.pos());
+            param = tmpT.val;
+        }
+
+        if (typeParams.empty())
+            Error::parserExpected(U"type parameter", U">", lexer.pos());
+    } else {
+        lexer.setIdx(idx);
+    }
+
+    auto lambda = parseLambda(tmpT, attrs);
+
+    auto f = lambda->toFunc(std::to_string(id));
+    f->setTypeParams(typeParams);
+    return f;
+}
+
+void Parser::parseFnAttrs(Lexer::Token& tmpT, unsigned& attrs) {
+    static const std::map<std::u32string, unsigned> names = {
+        { U"^inline",   AST::FN_INLINE },
+        { U"^noinline", AST::FN_NOINLINE },
+        { U"^pure",     AST::FN_PURE },
+        { U"^const",    AST::FN_CONST },
+        { U"^hot",      AST::FN_HOT },
+        { U"^cold",     AST::FN_COLD },
+        { U"^noreturn", AST::FN_NORETURN },
+        { U"^async",    AST::FN_ASYNC },
+    };
+
+    while (tmpT == Lexer::TT_ID && tmpT.val[0] == '^') {
+        auto it = names.find(tmpT.val);
+        if (it == names.end())
+            Error::parserExpected(U"function attribute", tmpT.val, lexer.pos());
+        attrs |= it->second;
+
+        // eat up attribute
+        tmpT = lexer.nextT();
+    }
 
-    return lambda->toFunc(std::to_string(id));
+    if ((attrs & AST::FN_INLINE && attrs & AST::FN_NOINLINE)
+        || (attrs & AST::FN_HOT && attrs & AST::FN_COLD)
+        || (attrs & AST::FN_ASYNC
+            && attrs & (AST::FN_INLINE | AST::FN_PURE | AST::FN_CONST)))
+        Error::parser(U"conflicting function attributes", lexer.pos());
 }
 
-AST::Lambda* Parser::parseLambda(Lexer::Token& tmpT) {
+AST::Lambda* Parser::parseLambda(Lexer::Token& tmpT, unsigned attrs) {
     // eat up 'fn' (or any other previous token)
     tmpT = lexer.nextT();
 
+    parseFnAttrs(tmpT, attrs);
+
     bool varArg = false;
     std::vector<std::pair<std::string, AST::Type*>> args;
 
@@ -650,7 +1118,7 @@ AST::Lambda* Parser::parseLambda(Lexer::Token& tmpT) {
 
     if (tmpT == Lexer::TT_EOF) Error::parser(U"unexpected end of file");
 
-    return new AST::Lambda(args, retType, body, varArg);
+    return new AST::Lambda(args, retType, body, varArg, attrs);
 }
 
 AST::Call* Parser::parseCall(Lexer::Token& tmpT) {
@@ -658,6 +1126,10 @@ AST::Call* Parser::parseCall(Lexer::Token& tmpT) {
         Error::parser(U"functions can only be defined at top level", lexer.pos());
     else if (tmpT == "deft")
         Error::parser(U"data types can only be defined at top level", lexer.pos());
+    else if (tmpT == "native-llvm" || tmpT == "native-c")
+        Error::parser(U"native code can only be embedded at top level", lexer.pos());
+    else if (tmpT == "defmacro")
+        Error::parser(U"macros can only be defined at top level", lexer.pos());
 
     auto callee = parseExpr(tmpT);
 
@@ -679,6 +1151,86 @@ AST::Call* Parser::parseCall(Lexer::Token& tmpT) {
     return new AST::Call(callee, args);
 }
 
+void Parser::parseMacro(Lexer::Token& tmpT) {
+    // eat up 'defmacro'
+    tmpT = lexer.nextT();
+
+    if (tmpT != Lexer::TT_ID)
+        Error::parserExpected(U"identifier", tmpT.val, lexer.pos());
+    auto id = tmpT.val;
+
+    // eat up identifier
+    tmpT = lexer.nextT();
+
+    if (tmpT != Lexer::TT_BRO)
+        Error::parserExpected(U"'['", tmpT.val, lexer.pos());
+
+    // eat up '['
+    tmpT = lexer.nextT();
+
+    Macro::Macro m;
+    while (tmpT == Lexer::TT_ID && tmpT != "&") {
+        m.params.push_back(tmpT.val);
+        tmpT = lexer.nextT();
+    }
+
+    // '& <identifier>' for the remaining arguments
+    if (tmpT == "&") {
+        tmpT = lexer.nextT();
+        if (tmpT != Lexer::TT_ID)
+            Error::parserExpected(U"identifier", tmpT.val, lexer.pos());
+        m.rest = tmpT.val;
+        tmpT = lexer.nextT();
+    }
+
+    if (tmpT != Lexer::TT_BRC)
+        Error::parserExpected(U"']'", tmpT.val, lexer.pos());
+
+    // eat up ']'
+    tmpT = lexer.nextT();
+
+    while (tmpT != Lexer::TT_EOF && tmpT != Lexer::TT_PC) {
+        m.body.push_back(Macro::read(lexer, tmpT));
+
+        // eat up remaining token
+        tmpT = lexer.nextT();
+    }
+
+    if (tmpT == Lexer::TT_EOF)
+        Error::parser(U"unexpected end of file");
+    if (m.body.empty())
+        Error::parserExpected(U"macro body", tmpT.val, lexer.pos());
+
+    macros[id] = m;
+}
+
+void Parser::expandMacro(Lexer::Token& tmpT, size_t start) {
+    auto id = tmpT.val;
+    auto pos = lexer.pos();
+
+    if (++expansions > 1000000)
+        Error::parser(U"too many macro expansions (does '" + id
+            + U"' expand to itself?)", pos);
+
+    // eat up identifier
+    tmpT = lexer.nextT();
+
+    std::vector<Macro::Form> args;
+    while (tmpT != Lexer::TT_EOF && tmpT != Lexer::TT_PC) {
+        args.push_back(Macro::read(lexer, tmpT));
+
+        // eat up remaining token
+        tmpT = lexer.nextT();
+    }
+
+    if (tmpT == Lexer::TT_EOF)
+        Error::parser(U"unexpected end of file");
+
+    lexer.replace(start, lexer.getIdx(), Macro::expand(macros[id], id, args, pos));
+    lexer.setIdx(start);
+    tmpT = lexer.nextT();
+}
+
 std::vector<AST::Expr*> Parser::parse() {
     std::vector<AST::Expr*> result;
 
@@ -688,7 +1240,8 @@ std::vector<AST::Expr*> Parser::parse() {
     std::vector<AST::Expr*> tmpExprs;
 
     while (tmpT != Lexer::TT_EOF) {
-        result.push_back(parseTopLevelExpr(tmpT));
+        // macro definitions and calls are no expressions
+        if (auto expr = parseTopLevelExpr(tmpT)) result.push_back(expr);
 
         // eat up remaining token
         tmpT = lexer.nextT();
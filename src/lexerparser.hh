@@ -1,6 +1,8 @@
 #pragma once
+#include <map>
 #include <string>
 #include <vector>
+#include <algorithm>
 
 #include "ast.hh"
 
@@ -19,6 +21,7 @@ public:
     TT_STAR,  // '*'
     TT_HASH,  // '#'
     TT_QUOTE, // '\''
+    TT_BACKQUOTE, // '`'
 
     TT_ID,    // [.^[0-9]]+
     TT_INT,   // [0-9]+
@@ -54,24 +57,113 @@ public:
   };
 
 private:
-  std::u32string text;
+  // the text is split at a gap: 'text' is the text before it and 'rest' the
+  // text after it in reverse, so a macro call ending at the gap is replaced by
+  // its expansion without moving the text after it
+  std::u32string text, rest;
   size_t idx = 0, lastIdx = 0;
   Token lastToken;
 
+  // index of the first character of the last token
+  size_t tokenIdx = 0;
+  // indices of the first character of every line up to the gap, and of the
+  // lines after it as distances from the end of the text (in reverse, so they
+  // don't change when text is replaced at the gap)
+  std::vector<size_t> lineStarts, restLineStarts;
+
+  size_t size() { return text.size() + rest.size(); }
+
+  char32_t at(size_t i) {
+    if (i < text.size())
+      return text[i];
+    return i < size() ? rest[size() - 1 - i] : 0;
+  }
+
+  // moves the gap to 'pos', macros are expanded in order so the gap only moves
+  // over the text lexed since the last expansion
+  void moveGap(size_t pos) {
+    for (; text.size() < pos; rest.pop_back()) {
+      text.push_back(rest.back());
+      if (text.back() == '\n') {
+        lineStarts.push_back(text.size());
+        restLineStarts.pop_back();
+      }
+    }
+    for (; text.size() > pos; text.pop_back()) {
+      if (text.back() == '\n') {
+        restLineStarts.push_back(size() - lineStarts.back());
+        lineStarts.pop_back();
+      }
+      rest.push_back(text.back());
+    }
+  }
+
+  // line and column (starting at 1) of the character at 'i'
+  std::pair<unsigned, unsigned> loc(size_t i) {
+    auto it = std::upper_bound(lineStarts.begin(), lineStarts.end(), i);
+    size_t line = it - lineStarts.begin(), start = lineStarts[line - 1];
+
+    // lines after the gap starting before the character
+    if (i >= text.size()) {
+      auto rit = std::lower_bound(restLineStarts.begin(), restLineStarts.end(),
+                                  size() - i);
+      line += restLineStarts.end() - rit;
+      if (rit != restLineStarts.end())
+        start = size() - *rit;
+    }
+
+    return {line, i - start + 1};
+  }
+
 public:
-  Lexer(const std::u32string &text) : text(text) {}
+  Lexer(const std::u32string &text) : text(text) {
+    lineStarts.push_back(0);
+    for (size_t i = 0; i < text.size(); i++)
+      if (text[i] == '\n')
+        lineStarts.push_back(i + 1);
+  }
 
   char getc(size_t idx) {
     if (eofReached())
       return -1;
-    return text[idx];
+    return at(idx);
   }
 
   void setIdx(size_t idx) { this->idx = idx; }
 
   size_t getIdx() { return idx; }
 
-  bool eofReached() { return idx >= text.size(); }
+  std::u32string slice(size_t start, size_t end) {
+    std::u32string s;
+    s.reserve(end - start);
+    for (size_t i = start; i < end; i++)
+      s.push_back(at(i));
+    return s;
+  }
+
+  bool eofReached() { return idx >= size(); }
+
+  // replaces the text in [start, end), i.e. a macro call by its expansion,
+  // padded with the newlines of the replaced text so the text after it keeps
+  // its lines
+  void replace(size_t start, size_t end, const std::u32string &s) {
+    moveGap(end);
+    auto lines = std::count(text.begin() + start, text.end(), '\n')
+                 - std::count(s.begin(), s.end(), '\n');
+    auto t = s + std::u32string(lines > 0 ? lines : 0, '\n');
+
+    text.resize(start);
+    while (lineStarts.back() > start)
+      lineStarts.pop_back();
+
+    // the expansion goes after the gap, so it is lexed next
+    size_t total = size() + t.size();
+    for (size_t i = t.size(); i-- > 0;) {
+      rest.push_back(t[i]);
+      if (t[i] == '\n')
+        restLineStarts.push_back(total - (start + i + 1));
+    }
+  }
 
   Token back() {
     this->idx = lastIdx;
@@ -79,46 +171,94 @@ public:
   }
 
   std::u32string pos() {
-    if (idx >= text.size())
+    if (idx >= size())
       return U"end of file";
 
-    size_t tmpIdx = 0, line = 1, col = 1;
-
-    while (tmpIdx < idx) {
-      if (text[tmpIdx + 1] == '\n' || text[tmpIdx + 1] == '\r') {
-        col = 1;
-        line += 1;
-      } else
-        col += 1;
-      tmpIdx += 1;
-    }
-
-    return std::stou32(std::to_string(line) + ":" + std::to_string(col));
+    auto l = loc(idx);
+    return std::stou32(std::to_string(l.first) + ":" + std::to_string(l.second));
   }
 
+  // line and column (starting at 1) of the last token
+  std::pair<unsigned, unsigned> tokenLoc() { return loc(tokenIdx); }
+
   Token nextT();
 };
 
+namespace Macro {
+
+// the s-expressions macros are evaluated on: a token, a list, a vector or a
+// homogeneous vector. quoted ('), quasi-quoted (`), unquoted (~) and
+// unquote-spliced (~@) forms are lists of the prefix and the form, spliced
+// ones are replaced by the forms they contain
+struct Form {
+  enum Kind { ATOM, LIST, VECTOR, HOMOVEC, SPLICE };
+
+  Kind kind = ATOM;
+  Lexer::Token t;
+  std::vector<Form> forms;
+
+  Form() {}
+  Form(Lexer::Token t) : t(t) {}
+  Form(Kind kind, std::vector<Form> forms = {}) : kind(kind), forms(forms) {}
+};
+
+struct Macro {
+  std::vector<std::u32string> params;
+  // the parameter after '&' gets the list of the remaining arguments
+  std::u32string rest;
+  std::vector<Form> body;
+};
+
+// reads the form starting with 'tmpT', leaving 'tmpT' at its last token
+Form read(Lexer &lexer, Lexer::Token &tmpT);
+
+// the code a call of 'm' with 'args' expands to
+std::u32string expand(const Macro &m, const std::u32string &id,
+                      const std::vector<Form> &args,
+                      const std::u32string &pos);
+
+// 'f' as code
+std::u32string str(const Form &f);
+
+} // namespace Macro
+
 class Parser {
 public:
   Lexer lexer;
 
+  // name of the file the parsed code is from
+  std::string filename;
+
   AST::Type *parseType(Lexer::Token &tmpT);
 
   AST::Expr *parseExpr(Lexer::Token &tmpT);
+  AST::Expr *parseExprWithoutLoc(Lexer::Token &tmpT);
   AST::Expr *parseTopLevelExpr(Lexer::Token &tmpT);
 
   AST::Expr *parseHoArray(Lexer::Token &tmpT);
   AST::Expr *parseHeArray(Lexer::Token &tmpT);
   AST::Expr *parseBinExpr(Lexer::Token &tmpT, AST::BinExprType bet);
   AST::Cast *parseCast(Lexer::Token &tmpT);
+  AST::Atomic *parseAtomic(Lexer::Token &tmpT);
   AST::If *parseIf(Lexer::Token &tmpT);
 
   AST::Function *parseFunction(Lexer::Token &tmpT);
-  AST::Lambda *parseLambda(Lexer::Token &tmpT);
+  AST::Lambda *parseLambda(Lexer::Token &tmpT, unsigned attrs = 0);
+  void parseFnAttrs(Lexer::Token &tmpT, unsigned &attrs);
   AST::Call *parseCall(Lexer::Token &tmpT);
 
-  Parser(const Lexer &lexer) : lexer(lexer) {}
+  std::map<std::u32string, Macro::Macro> macros;
+  // number of expanded macro calls and of the ones the expression that is
+  // parsed at the moment is in, to stop macros expanding to themselves
+  size_t expansions = 0, expansionDepth = 0;
+
+  void parseMacro(Lexer::Token &tmpT);
+  // replaces the macro call starting at 'start' by its expansion, the next
+  // token is the first one of it
+  void expandMacro(Lexer::Token &tmpT, size_t start);
+
+  Parser(const Lexer &lexer, const std::string &filename = "")
+      : lexer(lexer), filename(filename) {}
   std::vector<AST::Expr *> parse();
 };
 
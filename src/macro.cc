@@ -0,0 +1,400 @@
+// macros (defmacro) are evaluated while parsing: the forms of a macro call
+// are bound to the parameters of the macro, its body is evaluated on them and
+// the resulting form replaces the call in the source text
+
+#include "utils.hh"
+#include "lexerparser.hh"
+
+#include <cmath>
+#include <cstdio>
+
+using namespace Adscript;
+using namespace Adscript::Macro;
+
+typedef std::map<std::u32string, Form> Env;
+
+static bool isPrefix(const Lexer::Token &t) {
+    return t.tt == Lexer::TT_QUOTE || t.tt == Lexer::TT_BACKQUOTE
+        || (t.tt == Lexer::TT_ID && (t.val == U"~" || t.val == U"~@"));
+}
+
+// unquoted forms are identifiers starting with '~' or '~@', the unquoted form
+// follows them directly if they are nothing more
+static bool isUnquote(Lexer &lexer, const Lexer::Token &t) {
+    if (t.tt != Lexer::TT_ID || t.val[0] != '~') return false;
+    if (t.val.size() > 1) return true;
+    char c = lexer.getc(lexer.getIdx());
+    return !Utils::isWhitespace(c) && c != ')' && c != ']';
+}
+
+static Form readSeq(Lexer &lexer, Lexer::Token &tmpT, Form::Kind kind,
+        Lexer::TokenType close) {
+    Form f(kind);
+
+    // eat up '(' or '['
+    tmpT = lexer.nextT();
+
+    while (tmpT != Lexer::TT_EOF && tmpT != close) {
+        f.forms.push_back(read(lexer, tmpT));
+
+        // eat up remaining token
+        tmpT = lexer.nextT();
+    }
+
+    if (tmpT == Lexer::TT_EOF) Error::parser(U"unexpected end of file");
+
+    return f;
+}
+
+Form Macro::read(Lexer &lexer, Lexer::Token &tmpT) {
+    if (tmpT == Lexer::TT_PO)
+        return readSeq(lexer, tmpT, Form::LIST, Lexer::TT_PC);
+    else if (tmpT == Lexer::TT_BRO)
+        return readSeq(lexer, tmpT, Form::VECTOR, Lexer::TT_BRC);
+    else if (tmpT == Lexer::TT_HASH) {
+        // eat up '#'
+        tmpT = lexer.nextT();
+
+        if (tmpT != Lexer::TT_BRO)
+            Error::parserExpected(U"'['", tmpT.val, lexer.pos());
+
+        return readSeq(lexer, tmpT, Form::HOMOVEC, Lexer::TT_BRC);
+    } else if (tmpT == Lexer::TT_EOF) {
+        Error::parser(U"unexpected end of file");
+    } else if (tmpT == Lexer::TT_PC || tmpT == Lexer::TT_BRC) {
+        Error::parserExpected(U"form", tmpT.val, lexer.pos());
+    }
+
+    // the lexer reads '-4' as identifier, for macros it is a number
+    if (tmpT == Lexer::TT_ID && tmpT.val.size() > 1 && tmpT.val[0] == '-') {
+        auto digits = tmpT.val.substr(1);
+        auto dot = digits.find('.');
+        if (digits.find_first_not_of(U"0123456789.") == std::u32string::npos
+                && dot == digits.rfind('.') && dot != 0 && dot + 1 != digits.size())
+            return Form(Lexer::Token(dot == std::u32string::npos
+                ? Lexer::TT_INT : Lexer::TT_FLOAT, tmpT.val));
+    }
+
+    if (tmpT != Lexer::TT_QUOTE && tmpT != Lexer::TT_BACKQUOTE
+            && !isUnquote(lexer, tmpT))
+        return Form(tmpT);
+
+    // '~x' is read as '~ x'
+    auto prefix = tmpT;
+    size_t n = prefix.tt == Lexer::TT_ID && prefix.val.substr(0, 2) == U"~@" ? 2
+        : prefix.tt == Lexer::TT_ID ? 1 : prefix.val.size();
+
+    Form f(Form::LIST, { Form(Lexer::Token(prefix.tt, prefix.val.substr(0, n))) });
+    if (n < prefix.val.size()) {
+        f.forms.push_back(Form(Lexer::Token(Lexer::TT_ID, prefix.val.substr(n))));
+        return f;
+    }
+
+    // eat up prefix
+    tmpT = lexer.nextT();
+
+    f.forms.push_back(read(lexer, tmpT));
+    return f;
+}
+
+static std::u32string join(const std::vector<Form> &forms) {
+    std::u32string s;
+    for (auto &f : forms) s += (s.empty() ? U"" : U" ") + str(f);
+    return s;
+}
+
+std::u32string Macro::str(const Form &f) {
+    switch (f.kind) {
+    case Form::LIST:
+        if (f.forms.size() == 2 && f.forms[0].kind == Form::ATOM
+                && isPrefix(f.forms[0].t))
+            return f.forms[0].t.val + str(f.forms[1]);
+        return U"(" + join(f.forms) + U")";
+    case Form::VECTOR:  return U"[" + join(f.forms) + U"]";
+    case Form::HOMOVEC: return U"#[" + join(f.forms) + U"]";
+    case Form::SPLICE:  return join(f.forms);
+    case Form::ATOM:    break;
+    }
+
+    switch (f.t.tt) {
+    case Lexer::TT_STR:  return U"\"" + f.t.val + U"\"";
+    case Lexer::TT_CHAR: return U"\\" + f.t.val;
+    // there are no negative literals
+    case Lexer::TT_INT:
+    case Lexer::TT_FLOAT:
+        if (f.t.val[0] == '-') return U"(- " + f.t.val.substr(1) + U")";
+        return f.t.val;
+    default:             return f.t.val;
+    }
+}
+
+struct Evaluator {
+    const std::u32string &id, &pos;
+
+    void error(const std::u32string &msg) {
+        Error::parser(U"in macro '" + id + U"': " + msg, pos);
+    }
+
+    bool isNumber(const Form &f) {
+        return f.kind == Form::ATOM && (f.t.tt == Lexer::TT_INT
+            || f.t.tt == Lexer::TT_HEX || f.t.tt == Lexer::TT_FLOAT || f.t.tt == Lexer::TT_CHAR);
+    }
+
+    bool isSeq(const Form &f) {
+        return f.kind == Form::LIST || f.kind == Form::VECTOR
+            || f.kind == Form::HOMOVEC;
+    }
+
+    int64_t toInt(const Form &f) {
+        if (!isNumber(f)) error(U"expected number, got '" + str(f) + U"'");
+        if (f.t.tt == Lexer::TT_HEX) return std::stol(f.t.val, NULL, 16);
+        if (f.t.tt == Lexer::TT_CHAR) return f.t.val[0];
+        return f.t.tt == Lexer::TT_FLOAT ? std::stod(f.t.val) : std::stol(f.t.val);
+    }
+
+    double toFloat(const Form &f) {
+        if (f.kind == Form::ATOM && f.t.tt == Lexer::TT_FLOAT)
+            return std::stod(f.t.val);
+        return toInt(f);
+    }
+
+    Form fromInt(int64_t v) {
+        return Form(Lexer::Token(Lexer::TT_INT, std::stou32(std::to_string(v))));
+    }
+
+    Form fromFloat(double v) {
+        // the lexer reads neither exponents nor floats without a '.'
+        char buf[512];
+        snprintf(buf, sizeof(buf), "%.17g", v);
+        std::string s = buf;
+        if (s.find_first_of("einf") != std::string::npos) {
+            snprintf(buf, sizeof(buf), "%.17f", v);
+            s = buf;
+        }
+        if (s.find('.') == std::string::npos) s += ".0";
+        return Form(Lexer::Token(Lexer::TT_FLOAT, std::stou32(s)));
+    }
+
+    bool truthy(const Form &f) {
+        if (isNumber(f)) return toFloat(f) != 0;
+        return !isSeq(f) || !f.forms.empty();
+    }
+
+    const Form& seq(const Form &f) {
+        if (!isSeq(f)) error(U"expected list, got '" + str(f) + U"'");
+        return f;
+    }
+
+    // the text of identifiers and strings, the code of other forms
+    std::u32string text(const Form &f) {
+        if (f.kind == Form::ATOM
+                && (f.t.tt == Lexer::TT_ID || f.t.tt == Lexer::TT_STR))
+            return f.t.val;
+        return str(f);
+    }
+
+    Form eval(const Form &f, Env &env);
+    Form quasi(const Form &f, Env &env);
+    Form call(const std::u32string &op, const std::vector<Form> &args);
+};
+
+Form Evaluator::quasi(const Form &f, Env &env) {
+    if (f.kind == Form::ATOM) return f;
+
+    if (f.kind == Form::LIST && f.forms.size() == 2
+            && f.forms[0].kind == Form::ATOM && f.forms[0].t.val == U"~")
+        return eval(f.forms[1], env);
+
+    Form result(f.kind);
+    for (auto &form : f.forms) {
+        if (form.kind == Form::LIST && form.forms.size() == 2
+                && form.forms[0].kind == Form::ATOM && form.forms[0].t.val == U"~@") {
+            auto spliced = seq(eval(form.forms[1], env));
+            result.forms.insert(result.forms.end(), spliced.forms.begin(),
+                spliced.forms.end());
+        } else {
+            result.forms.push_back(quasi(form, env));
+        }
+    }
+
+    return result;
+}
+
+Form Evaluator::eval(const Form &f, Env &env) {
+    if (f.kind == Form::ATOM) {
+        if (f.t.tt != Lexer::TT_ID) return f;
+
+        auto it = env.find(f.t.val);
+        if (it == env.end()) error(U"undefined variable '" + f.t.val + U"'");
+        return it->second;
+    } else if (f.kind != Form::LIST) {
+        Form result(f.kind);
+        for (auto &form : f.forms) result.forms.push_back(eval(form, env));
+        return result;
+    } else if (f.forms.empty()) {
+        return f;
+    }
+
+    auto &head = f.forms[0];
+    auto op = head.kind == Form::ATOM ? head.t.val : U"";
+
+    if (head.kind == Form::ATOM && head.t.tt == Lexer::TT_QUOTE)
+        return f.forms[1];
+    else if (head.kind == Form::ATOM && head.t.tt == Lexer::TT_BACKQUOTE)
+        return quasi(f.forms[1], env);
+    else if (op == U"~" || op == U"~@")
+        error(U"unquote outside of a quasi-quote");
+
+    if (op == U"if") {
+        if (f.forms.size() != 4) error(U"expected (if <condition> <then> <else>)");
+        return eval(f.forms[truthy(eval(f.forms[1], env)) ? 2 : 3], env);
+    } else if (op == U"let" || op == U"for") {
+        // (let [<id> <value> ...] <body>), (for [<id> <list>] <body>)
+        if (f.forms.size() < 3 || f.forms[1].kind != Form::VECTOR
+                || f.forms[1].forms.size() % 2 || (op == U"for" && f.forms[1].forms.size() != 2))
+            error(U"expected (" + op + U" [<identifier> <value>] <body>)");
+
+        Env scope = env;
+        auto &bindings = f.forms[1].forms;
+        for (size_t i = 0; i < bindings.size(); i += 2) {
+            if (bindings[i].kind != Form::ATOM || bindings[i].t.tt != Lexer::TT_ID)
+                error(U"expected identifier, got '" + str(bindings[i]) + U"'");
+            scope[bindings[i].t.val] = eval(bindings[i + 1], scope);
+        }
+
+        if (op == U"let") {
+            Form result;
+            for (size_t i = 2; i < f.forms.size(); i++) result = eval(f.forms[i], scope);
+            return result;
+        }
+
+        Form result(Form::LIST);
+        auto list = seq(scope[bindings[0].t.val]).forms;
+        for (auto &v : list) {
+            scope[bindings[0].t.val] = v;
+            Form last;
+            for (size_t i = 2; i < f.forms.size(); i++) last = eval(f.forms[i], scope);
+            result.forms.push_back(last);
+        }
+        return result;
+    }
+
+    std::vector<Form> args;
+    for (size_t i = 1; i < f.forms.size(); i++) args.push_back(eval(f.forms[i], env));
+
+    return call(op, args);
+}
+
+Form Evaluator::call(const std::u32string &op, const std::vector<Form> &args) {
+    static size_t gensyms = 0;
+
+    auto arity = [&](size_t min, size_t max) {
+        if (args.size() < min || args.size() > max)
+            error(U"wrong number of arguments for '" + op + U"'");
+    };
+
+    if (Utils::strEq(op, {U"+", U"-", U"*", U"/", U"%"})) {
+        arity(1, -1);
+
+        bool floats = false;
+        for (auto &arg : args) {
+            if (!isNumber(arg)) error(U"expected number, got '" + str(arg) + U"'");
+            floats |= arg.t.tt == Lexer::TT_FLOAT;
+        }
+
+        if (args.size() == 1 && op == U"-")
+            return floats ? fromFloat(-toFloat(args[0])) : fromInt(-toInt(args[0]));
+
+        double fv = toFloat(args[0]);
+        int64_t iv = toInt(args[0]);
+        for (size_t i = 1; i < args.size(); i++) {
+            double fa = toFloat(args[i]);
+            int64_t ia = toInt(args[i]);
+            if ((op == U"/" || op == U"%") && !ia && !floats)
+                error(U"division by zero");
+
+            if (op == U"+") fv += fa, iv += ia;
+            else if (op == U"-") fv -= fa, iv -= ia;
+            else if (op == U"*") fv *= fa, iv *= ia;
+            else if (op == U"/") fv /= fa, iv = ia ? iv / ia : 0;
+            else fv = std::fmod(fv, fa), iv = ia ? iv % ia : 0;
+        }
+
+        return floats ? fromFloat(fv) : fromInt(iv);
+    } else if (Utils::strEq(op, {U"<", U">", U"<=", U">="})) {
+        arity(2, 2);
+        double a = toFloat(args[0]), b = toFloat(args[1]);
+        return fromInt(op == U"<" ? a < b : op == U">" ? a > b
+            : op == U"<=" ? a <= b : a >= b);
+    } else if (op == U"=") {
+        arity(2, 2);
+        if (isNumber(args[0]) && isNumber(args[1]))
+            return fromInt(toFloat(args[0]) == toFloat(args[1]));
+        return fromInt(str(args[0]) == str(args[1]));
+    } else if (op == U"not") {
+        arity(1, 1);
+        return fromInt(!truthy(args[0]));
+    } else if (op == U"list") {
+        return Form(Form::LIST, args);
+    } else if (op == U"concat") {
+        Form result(Form::LIST);
+        for (auto &arg : args)
+            result.forms.insert(result.forms.end(), seq(arg).forms.begin(),
+                arg.forms.end());
+        return result;
+    } else if (op == U"count") {
+        arity(1, 1);
+        return fromInt(seq(args[0]).forms.size());
+    } else if (op == U"nth") {
+        arity(2, 2);
+        auto i = toInt(args[1]);
+        if (i < 0 || i >= (int64_t) seq(args[0]).forms.size())
+            error(U"index out of range");
+        return args[0].forms[i];
+    } else if (op == U"range") {
+        // (range <end>), (range <start> <end>)
+        arity(1, 2);
+        Form result(Form::LIST);
+        auto end = toInt(args.back());
+        for (auto i = args.size() == 2 ? toInt(args[0]) : 0; i < end; i++)
+            result.forms.push_back(fromInt(i));
+        return result;
+    } else if (op == U"str" || op == U"symbol") {
+        std::u32string s;
+        for (auto &arg : args) s += text(arg);
+        return Form(Lexer::Token(op == U"str" ? Lexer::TT_STR : Lexer::TT_ID, s));
+    } else if (op == U"gensym") {
+        // '$' is in no identifier the macro is called with, usually
+        arity(0, 1);
+        auto prefix = args.empty() ? U"g" : text(args[0]);
+        return Form(Lexer::Token(Lexer::TT_ID,
+            prefix + U"$" + std::stou32(std::to_string(++gensyms))));
+    } else if (op == U"splice") {
+        arity(1, 1);
+        return Form(Form::SPLICE, seq(args[0]).forms);
+    }
+
+    error(U"unknown function '" + op + U"'");
+    return Form();
+}
+
+std::u32string Macro::expand(const Macro &m, const std::u32string &id,
+        const std::vector<Form> &args, const std::u32string &pos) {
+    Evaluator e { id, pos };
+
+    if (args.size() < m.params.size())
+        e.error(U"too few arguments");
+    else if (args.size() > m.params.size() && m.rest.empty())
+        e.error(U"too many arguments");
+
+    Env env;
+    for (size_t i = 0; i < m.params.size(); i++) env[m.params[i]] = args[i];
+    if (!m.rest.empty())
+        env[m.rest] = Form(Form::LIST,
+            std::vector<Form>(args.begin() + m.params.size(), args.end()));
+
+    Form result;
+    for (auto &form : m.body) result = e.eval(form, env);
+
+    return str(result);
+}
@@ -1,4 +1,5 @@
 #include "utils.hh"
+#include "trace.hh"
 #include "lexerparser.hh"
 #include "compiler.hh"
 
@@ -13,33 +14,70 @@ using namespace Adscript;
 int main(int argc, char **argv) {
     if (argc < 2) return Error::printUsage(argv, 1);
 
-    std::string output, target;
-    bool exe = false, emitLLVM = false;
+    std::string output, traceFile;
+    Compiler::Options opts;
+    bool timeTrace = false;
     int opt, idx;
     opterr = 1;
 
     static const struct option long_getopt_options[] = {
         {"executable",  no_argument,        nullptr, 'e'},
         {"llvm-ir",     no_argument,        nullptr, 'l'},
+        {"debug",       no_argument,        nullptr, 'g'},
 
         {"help",        no_argument,        nullptr, 'h'},
         {"version",     no_argument,        nullptr, 'v'},
 
         {"output",      required_argument,  nullptr, 'o'},
         {"target",      required_argument,  nullptr, 't'},
+        {"cache",       required_argument,  nullptr, 'c'},
+        {"time-trace",  optional_argument,  nullptr, 'T'},
+        {"clang",       required_argument,  nullptr, 'C'},
+        {"instrument-functions", no_argument,   nullptr, 'I'},
+        {"remarks-file", required_argument,     nullptr, 'R'},
+
+        {"profile-generate",    optional_argument,  nullptr, 'G'},
+        {"profile-use",         required_argument,  nullptr, 'U'},
+        {"profile-sample-use",  required_argument,  nullptr, 'S'},
         {nullptr, 0, nullptr, 0},
     };
 
-    const char *shortopts = "elvho:t:";
+    const char *shortopts = "elgvho:t:c:";
+
+    // -Rpass=<regex> style options are no options getopt can parse
+    int args = 1;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (!arg.rfind("-Rpass=", 0)) opts.remarksPassed = arg.substr(7);
+        else if (!arg.rfind("-Rpass-missed=", 0)) opts.remarksMissed = arg.substr(14);
+        else if (!arg.rfind("-Rpass-analysis=", 0)) opts.remarksAnalysis = arg.substr(16);
+        else argv[args++] = argv[i];
+    }
+    argc = args;
 
     while ((opt = getopt_long(argc, argv, shortopts, long_getopt_options, &idx)) != -1) {
         switch (opt) {
-            case 'e': exe = true; break;
-            case 'l': emitLLVM = true; break;
+            case 'e': opts.exe = true; break;
+            case 'l': opts.emitLLVM = true; break;
+            case 'g': opts.debugInfo = true; break;
             case 'v': std::puts("Adscript 0.6 by Amplus 2.0"); exit(0);
             case 'h': return Error::printUsage(argv, 0);
             case 'o': output = optarg; break;
-            case 't': target = optarg; break;
+            case 't': opts.target = optarg; break;
+            case 'c': opts.cacheDir = optarg; break;
+            case 'C': opts.clang = optarg; break;
+            case 'I': opts.instrumentFunctions = true; break;
+            case 'R': opts.remarksFile = optarg; break;
+            case 'T':
+                timeTrace = true;
+                if (optarg) traceFile = optarg;
+                break;
+            case 'G':
+                opts.profileGenerate = true;
+                if (optarg) opts.profileOutput = optarg;
+                break;
+            case 'U': opts.profileUse = optarg; break;
+            case 'S': opts.profileSampleUse = optarg; break;
         }
     }
 
@@ -47,21 +85,49 @@ int main(int argc, char **argv) {
     if (!argc) return Error::printUsage(argv, 1);
     argv += optind;
 
-    if (target == "") target = llvm::sys::getDefaultTargetTriple();
+    if (opts.target == "") opts.target = llvm::sys::getDefaultTargetTriple();
+
+    if (!opts.profileSampleUse.empty()) {
+        if (opts.profileGenerate || !opts.profileUse.empty())
+            Error::compiler(U"--profile-sample-use cannot be combined with "
+                            U"instrumented profiles");
+        // samples are matched to the code by line
+        opts.debugInfo = true;
+    }
+
+    // remarks are positioned by the debug locations of the code
+    if (!opts.remarksPassed.empty() || !opts.remarksMissed.empty()
+            || !opts.remarksAnalysis.empty() || !opts.remarksFile.empty())
+        opts.debugInfo = true;
+
+    if (timeTrace) {
+        if (traceFile == "")
+            traceFile = (output == ""
+                ? Utils::makeOutputPath(argv[0], opts.exe) : output) + ".json";
+        Trace::enable();
+    }
 
     if (output == "") {
         for (int i = 0; i < argc; i++) {
             std::string input = std::string(argv[i]);
-            std::string output = Utils::makeOutputPath(input, exe);
+            std::string output = Utils::makeOutputPath(input, opts.exe);
+
+            Trace::Scope scope("File", input);
+
+            Trace::begin("ReadFile", input);
             std::u32string text = Utils::readFile(input);
+            Trace::end();
 
+            // lexing is done on demand while parsing
+            Trace::begin("Parse", input);
             Lexer lexer(text);
-            Parser parser(lexer);
+            Parser parser(lexer, input);
             auto exprs = parser.parse();
+            Trace::end();
 
             //printAST(exprs);
 
-            Compiler::compile(exprs, exe, output, target, emitLLVM);
+            Compiler::compile(exprs, output, opts);
 
             for (auto& expr : exprs) expr->~Expr();
         }
@@ -69,18 +135,28 @@ int main(int argc, char **argv) {
         std::vector<AST::Expr*> exprs;
 
         for (int i = 0; i < argc; i++) {
+            Trace::Scope scope("File", argv[i]);
+
+            Trace::begin("ReadFile", argv[i]);
             std::u32string text = Utils::readFile(argv[i]);
+            Trace::end();
+
+            Trace::begin("Parse", argv[i]);
             Lexer lexer(text);
-            Parser parser(lexer);
+            Parser parser(lexer, argv[i]);
             auto newexprs = parser.parse();
             exprs.insert(exprs.end(), newexprs.begin(), newexprs.end());
+            Trace::end();
         }
 
         //printAST(exprs);
 
-        Compiler::compile(exprs, exe, output, target, emitLLVM);
+        Compiler::compile(exprs, output, opts);
 
         for (auto& expr : exprs) expr->~Expr();
     }
+
+    Trace::write(traceFile);
+
     return 0;
 }
@@ -0,0 +1,107 @@
+#include "trace.hh"
+#include "utils.hh"
+
+#include <chrono>
+#include <vector>
+#include <fstream>
+
+#include <sys/resource.h>
+
+using namespace Adscript;
+
+struct Event {
+    std::string name, detail;
+    uint64_t start, dur;
+    // the peak rss is the high-water mark of the whole process so far, a
+    // span only shows how much it raised it
+    long startPeakRSS, peakRSS;
+};
+
+static bool traceEnabled = false;
+static std::vector<Event> events;
+static std::vector<size_t> openEvents;
+static std::chrono::steady_clock::time_point epoch;
+
+static uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - epoch).count();
+}
+
+// peak resident set size of the process since it started in KiB
+static long peakRSS() {
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru)) return 0;
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1024;
+#else
+    return ru.ru_maxrss;
+#endif
+}
+
+static std::string escape(const std::string& s) {
+    std::string result;
+    for (char c : s) {
+        switch (c) {
+        case '"':  result += "\\\""; break;
+        case '\\': result += "\\\\"; break;
+        case '\n': result += "\\n"; break;
+        case '\t': result += "\\t"; break;
+        default:
+            if ((unsigned char) c < 32) continue;
+            result += c;
+        }
+    }
+    return result;
+}
+
+void Trace::enable() {
+    traceEnabled = true;
+    epoch = std::chrono::steady_clock::now();
+}
+
+bool Trace::enabled() {
+    return traceEnabled;
+}
+
+void Trace::begin(const std::string& name, const std::string& detail) {
+    if (!traceEnabled) return;
+    openEvents.push_back(events.size());
+    events.push_back({ name, detail, now(), 0, peakRSS(), 0 });
+}
+
+void Trace::end() {
+    if (!traceEnabled || openEvents.empty()) return;
+    auto& e = events[openEvents.back()];
+    openEvents.pop_back();
+    e.dur = now() - e.start;
+    e.peakRSS = peakRSS();
+}
+
+void Trace::write(const std::string& filename) {
+    if (!traceEnabled) return;
+
+    std::ofstream os(filename);
+    if (!os.good())
+        Error::def(U"cannot write to file '" + std::stou32(filename) + U"'");
+
+    os << "{\"traceEvents\":[\n";
+    os << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+       << "\"args\":{\"name\":\"adscript\"}}";
+
+    for (auto& e : events) {
+        os << ",\n{\"name\":\"" << escape(e.name) << "\",\"ph\":\"X\",\"pid\":1,"
+           << "\"tid\":0,\"ts\":" << e.start << ",\"dur\":" << e.dur
+           << ",\"args\":{";
+        if (e.detail.size() > 0)
+            os << "\"detail\":\"" << escape(e.detail) << "\",";
+        os << "\"peak RSS growth (KiB)\":" << e.peakRSS - e.startPeakRSS
+           << ",\"process peak RSS (KiB)\":" << e.peakRSS << "}}";
+
+        // also plot the peak rss of the process as a counter track
+        os << ",\n{\"name\":\"process peak RSS (KiB)\",\"ph\":\"C\",\"pid\":1,"
+           << "\"tid\":0,\"ts\":" << e.start + e.dur
+           << ",\"args\":{\"KiB\":" << e.peakRSS << "}}";
+    }
+
+    os << "\n],\"displayTimeUnit\":\"ms\"}" << std::endl;
+}
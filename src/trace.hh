@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+
+namespace Adscript {
+namespace Trace {
+
+void enable();
+bool enabled();
+
+// spans have to be closed in the reverse order they were opened in
+void begin(const std::string &name, const std::string &detail = "");
+void end();
+
+// writes all recorded spans as chrome trace-event json (chrome://tracing,
+// https://ui.perfetto.dev)
+void write(const std::string &filename);
+
+class Scope {
+public:
+  Scope(const std::string &name, const std::string &detail = "") {
+    begin(name, detail);
+  }
+  ~Scope() { end(); }
+};
+
+} // namespace Trace
+} // namespace Adscript
@@ -93,7 +93,9 @@ void Error::warning(const std::u32string& msg, const std::u32string& pos) {
 }
 
 int Error::printUsage(char **argv, int r) {
-    std::cout << "usage: " << argv[0] << " [-ehlv] [-o <file>] [-t <target-triple>] <files>" << std::endl;
+    std::cout << "usage: " << argv[0] << " [-eghlv] [-c <dir>] [-o <file>] [-t <target-triple>] [--time-trace[=<file>]] [--clang=<path>] [--instrument-functions]"
+        " [-Rpass[-missed|-analysis]=<regex>] [--remarks-file=<file>]"
+        " [--profile-generate[=<file>]] [--profile-use=<file>] [--profile-sample-use=<file>] <files>" << std::endl;
     return r;
 }
 
@@ -153,7 +155,8 @@ bool Utils::isSpecialChar(char c) {
         || c == '['
         || c == ']'
         || c == '#'
-        || c == '*';
+        || c == '*'
+        || c == '`';
 }
 
 bool Utils::isHexChar(char c) {
@@ -227,16 +230,6 @@ std::u32string AST::argVectorToStr(const std::vector<std::pair<std::string, AST:
     return AST::strVectorToStr(tmp);
 }
 
-std::u32string AST::attrMapToStr(const std::map<std::string, AST::Type*>& map) {
-    std::u32string result = U"{ ";
-    size_t i = 0;
-    for (auto& attr : map) {
-        result += std::stou32(attr.first) + U": " + attr.second->str();
-        if (i < map.size() - 1) result += U", ";
-    }
-    return result + U" }";
-}
-
 void AST::print(const std::vector<AST::Expr*>& ast) {
     for (auto& expr : ast) std::cout << expr->str() << std::endl;
 }
@@ -262,6 +255,38 @@ std::u32string Compiler::llvmTypeStr(llvm::Type *t) {
     return std::stou32(s.str());
 }
 
+// wraps function 'f' into a closure of type 't' without an environment
+static llvm::Value* functionToClosure(Compiler::Context& ctx, llvm::Value *f,
+                                      llvm::StructType *t) {
+    auto ft = llvm::cast<llvm::FunctionType>(
+        f->getType()->getPointerElementType());
+    auto closureFT = llvm::cast<llvm::FunctionType>(
+        t->getElementType(0)->getPointerElementType());
+
+    if (ft->isVarArg() || closureFT->getReturnType() != ft->getReturnType()
+            || closureFT->params().drop_front() != ft->params())
+        return nullptr;
+
+    // calls 'f' ignoring the environment
+    auto thunk = llvm::Function::Create(closureFT,
+        llvm::Function::PrivateLinkage, "thunk", ctx.mod);
+    llvm::IRBuilder<> builder(
+        llvm::BasicBlock::Create(ctx.mod->getContext(), "", thunk));
+
+    std::vector<llvm::Value*> args;
+    for (auto& arg : thunk->args()) {
+        if (arg.getArgNo() > 0) args.push_back(&arg);
+    }
+    auto call = builder.CreateCall(ft, f, args);
+    if (ft->getReturnType()->isVoidTy()) builder.CreateRetVoid();
+    else builder.CreateRet(call);
+
+    llvm::Value *closure = llvm::UndefValue::get(t);
+    closure = ctx.builder->CreateInsertValue(closure, thunk, 0);
+    return ctx.builder->CreateInsertValue(closure,
+        llvm::Constant::getNullValue(t->getElementType(1)), 1);
+}
+
 llvm::Value* Compiler::tryCast(Compiler::Context& ctx, llvm::Value *v, llvm::Type *t) {
     if (!t) return nullptr;
 
@@ -293,6 +318,8 @@ llvm::Value* Compiler::tryCast(Compiler::Context& ctx, llvm::Value *v, llvm::Typ
             return ctx.builder->CreatePtrToInt(v, t);
         } else if (t->isPointerTy()) {
             return ctx.builder->CreatePointerCast(v, t);
+        } else if (isFunctionTy(vT) && isClosureTy(t)) {
+            return functionToClosure(ctx, v, llvm::cast<llvm::StructType>(t));
         }
     }
 
@@ -326,17 +353,51 @@ llvm::Value* Compiler::createLogicalVal(Compiler::Context& ctx, llvm::Value *v)
     return nullptr;
 }
 
-llvm::AllocaInst* Compiler::createAlloca(llvm::Function *f, llvm::Type *type) {
+llvm::AllocaInst* Compiler::createAlloca(llvm::Function *f, llvm::Type *type,
+                                         unsigned align) {
     llvm::IRBuilder<> builder(
         &(f->getEntryBlock()), f->getEntryBlock().begin());
-    return builder.CreateAlloca(type);
+    auto alloca = builder.CreateAlloca(type);
+    if (align) alloca->setAlignment(llvm::Align(align));
+    return alloca;
+}
+
+void Compiler::addFnAttrs(llvm::Function *f, unsigned attrs) {
+    if (attrs & AST::FN_INLINE) f->addFnAttr(llvm::Attribute::AlwaysInline);
+    if (attrs & AST::FN_NOINLINE) f->addFnAttr(llvm::Attribute::NoInline);
+    if (attrs & AST::FN_HOT) f->addFnAttr(llvm::Attribute::Hot);
+    if (attrs & AST::FN_COLD) f->addFnAttr(llvm::Attribute::Cold);
+    if (attrs & AST::FN_NORETURN) f->addFnAttr(llvm::Attribute::NoReturn);
+
+    // pure functions always return and have no side effects, so calls to them
+    // can be merged, hoisted out of loops and removed if unused
+    if (attrs & (AST::FN_PURE | AST::FN_CONST)) {
+        f->addFnAttr(attrs & AST::FN_CONST
+            ? llvm::Attribute::ReadNone : llvm::Attribute::ReadOnly);
+        f->addFnAttr(llvm::Attribute::NoUnwind);
+        f->addFnAttr(llvm::Attribute::WillReturn);
+    }
 }
 
 bool Compiler::isNumTy(llvm::Type *t) {
-    return t->isFloatTy()
+    return t->isFloatingPointTy()
         || t->isIntegerTy();
 }
 
 bool Compiler::isFunctionTy(llvm::Type *t) {
-    return t->isFunctionTy();
+    return t->isFunctionTy() || (t->isPointerTy()
+        && t->getPointerElementType()->isFunctionTy());
+}
+
+bool Compiler::isClosureTy(llvm::Type *t) {
+    auto st = llvm::dyn_cast<llvm::StructType>(t);
+    if (!st || !st->isLiteral() || st->getNumElements() != 2
+            || !isFunctionTy(st->getElementType(0)))
+        return false;
+
+    auto envT = llvm::Type::getInt8PtrTy(t->getContext());
+    auto ft = llvm::cast<llvm::FunctionType>(
+        st->getElementType(0)->getPointerElementType());
+    return st->getElementType(1) == envT && ft->getNumParams() > 0
+        && ft->getParamType(0) == envT;
 }
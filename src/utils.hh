@@ -85,7 +85,6 @@ std::u32string strVectorToStr(const std::vector<std::u32string> &vector);
 std::u32string exprVectorToStr(const std::vector<Expr *> &vector);
 std::u32string
 argVectorToStr(const std::vector<std::pair<std::string, Type *>> &vector);
-std::u32string attrMapToStr(const std::map<std::string, Type *> &map);
 
 void print(const std::vector<Expr *> &ast);
 
@@ -106,10 +105,20 @@ llvm::Value *cast(::Adscript::Compiler::Context &ctx, llvm::Value *v,
 llvm::Value *createLogicalVal(::Adscript::Compiler::Context &ctx,
                               llvm::Value *v);
 
-llvm::AllocaInst *createAlloca(llvm::Function *f, llvm::Type *type);
+// in the entry block of 'f', aligned to 'align' bytes unless it is 0 (i.e. for
+// the explicit alignment of struct types, see Context::getAlign)
+llvm::AllocaInst *createAlloca(llvm::Function *f, llvm::Type *type,
+                               unsigned align = 0);
+
+// adds the llvm attributes for the AST::FnAttr flags in 'attrs' to 'f'
+void addFnAttrs(llvm::Function *f, unsigned attrs);
 
 bool isNumTy(llvm::Type *t);
+// functions and function pointers
 bool isFunctionTy(llvm::Type *t);
+// '{ fn*, i8* }' pairs of a function taking the environment as its first
+// argument and the environment
+bool isClosureTy(llvm::Type *t);
 
 } // namespace Compiler
 } // namespace Adscript
@@ -1,8 +1,21 @@
 #include <chrono>
+#include <string>
+#include <vector>
+#include <cstring>
 #include <iostream>
+#include <algorithm>
 #include <stdint.h>
 
 extern "C" int64_t ads_fib(int64_t);
+extern "C" int64_t ads_sum(int64_t*, int64_t, int64_t);
+extern "C" int64_t ads_count_char(char*, char, int64_t, int64_t);
+extern "C" double ads_harmonic(int64_t, double);
+extern "C" int64_t ads_square(int64_t);
+extern "C" int64_t ads_classify(char*, int64_t, int64_t);
+extern "C" int64_t ads_pfib(int64_t);
+extern "C" int64_t ads_quicksort(int64_t*, int64_t, int64_t);
+extern "C" int64_t ads_pquicksort(int64_t*, int64_t, int64_t);
+extern "C" int64_t ads_sum_squares(int64_t);
 
 int64_t cxx_fib(int64_t n) {
         if (n < 2) return n;
@@ -10,44 +23,216 @@ int64_t cxx_fib(int64_t n) {
         return cxx_fib(n - 1) + cxx_fib(n - 2);
 }
 
-// not used currently
-int64_t cxx_ifib(int64_t n) {
-        if (n <= 0) return 0;
-        else if (n == 1) return 1;
+int64_t cxx_sum(int64_t *a, int64_t n) {
+        int64_t acc = 0;
+        for (int64_t i = 0; i < n; i++) acc += a[i];
+        return acc;
+}
+
+int64_t cxx_count_char(const char *s, char c) {
+        int64_t acc = 0;
+        for (; *s; s++) acc += *s == c;
+        return acc;
+}
+
+double cxx_harmonic(int64_t n) {
+        double acc = 0;
+        for (; n > 0; n--) acc += 1.0 / n;
+        return acc;
+}
 
-        int64_t a = 0, b = 1, c;
-        for (int64_t i = 0; i < n; i++) {
-                c = a + b;
-                a = b;
-                b = c;
+int64_t cxx_square(int64_t x) {
+        return x * x;
+}
+
+int64_t cxx_char_class(char c) {
+        if (c == ' ') return 0;
+        else if (c < '0') return 1;
+        else if (c <= '9') return 2;
+        else if (c < 'A') return 3;
+        else if (c <= 'Z') return 4;
+        else if (c < 'a') return 5;
+        else if (c <= 'z') return 6;
+        return 7;
+}
+
+int64_t cxx_classify(const char *s) {
+        int64_t acc = 0;
+        for (; *s; s++) acc = acc * 31 + cxx_char_class(*s);
+        return acc;
+}
+
+void cxx_quicksort(int64_t *a, int64_t lo, int64_t hi) {
+        if (lo >= hi) return;
+
+        int64_t i = lo;
+        for (int64_t j = lo; j < hi; j++)
+                if (a[j] < a[hi]) std::swap(a[i++], a[j]);
+        std::swap(a[i], a[hi]);
+
+        cxx_quicksort(a, lo, i - 1);
+        cxx_quicksort(a, i + 1, hi);
+}
+
+// the hand-written state machine of a generator
+struct Squares {
+        int64_t i = 0, n;
+        Squares(int64_t n) : n(n) {}
+        bool next(int64_t *v) {
+                if (i >= n) return false;
+                *v = i * i;
+                i++;
+                return true;
         }
-        return a;
+};
+
+int64_t cxx_sum_squares(int64_t n) {
+        Squares g(n);
+        int64_t sum = 0, v;
+        while (g.next(&v)) sum += v;
+        return sum;
+}
+
+int64_t apply_n(int64_t (*f)(int64_t), int64_t n) {
+        int64_t acc = 0;
+        for (int64_t i = 0; i < n; i++) acc += f(i);
+        return acc;
 }
 
-using std::chrono::time_point;
-using std::chrono::microseconds;
-using std::chrono::high_resolution_clock;
+using std::chrono::nanoseconds;
+using std::chrono::duration_cast;
+using std::chrono::steady_clock;
+
+struct Result {
+        std::string name, impl;
+        double median, p95, min;
+};
 
+int warmups = 3, reps = 20;
 
-template <class c, class d>
-void print_result(const std::string& name, const time_point<c, d> &start, const time_point<c, d> &end) {
-        const auto res = end - start;
-        std::cout << name << res.count() << " µs" << std::endl;
+// keeps the compiler from throwing away the benchmarked calls
+volatile double sink;
+
+template <class F>
+Result run(const std::string &name, const std::string &impl, F f) {
+        for (int i = 0; i < warmups; i++) sink = f();
+
+        std::vector<double> times;
+        for (int i = 0; i < reps; i++) {
+                const auto start = steady_clock::now();
+                sink = f();
+                const auto end = steady_clock::now();
+                times.push_back(duration_cast<nanoseconds>(end - start).count());
+        }
+
+        std::sort(times.begin(), times.end());
+
+        const size_t n = times.size();
+        const double median = n % 2 ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2;
+        const double p95 = times[std::min(n - 1, (size_t) (n * 0.95))];
+
+        return { name, impl, median, p95, times[0] };
+}
+
+template <class T>
+void check(const std::string &name, T cxx, T ads) {
+        if (cxx == ads) return;
+        std::cerr << name << ": results differ (C++: " << cxx << ", Adscript: " << ads << ")" << std::endl;
+        exit(1);
 }
 
-int main() {
-        const int64_t fr = 45;
+int main(int argc, char **argv) {
+        bool csv = false;
+        for (int i = 1; i < argc; i++) {
+                if (!strcmp(argv[i], "--csv")) csv = true;
+                else if (!strcmp(argv[i], "--reps") && i + 1 < argc) reps = atoi(argv[++i]);
+                else if (!strcmp(argv[i], "--warmups") && i + 1 < argc) warmups = atoi(argv[++i]);
+                else {
+                        std::cerr << "usage: " << argv[0] << " [--csv] [--reps <n>] [--warmups <n>]" << std::endl;
+                        return 1;
+                }
+        }
+        if (reps < 1) reps = 1;
+
+        const int64_t fr = 32;
 
-        std::cout << "Calculating fib of " << fr << std::endl;
+        std::vector<int64_t> arr(1 << 20);
+        for (size_t i = 0; i < arr.size(); i++) arr[i] = i * 7 % 1000;
 
-        const auto cxx_start = high_resolution_clock::now();
-        std::cout << "C++ result:\t\t" << cxx_fib(fr) << std::endl;
-        const auto cxx_end = high_resolution_clock::now();
+        std::string str(1 << 20, 'b');
+        for (size_t i = 0; i < str.size(); i += 3) str[i] = 'a';
 
-        const auto ads_start = high_resolution_clock::now();
-        std::cout << "Adscript result:\t" << ads_fib(fr) << std::endl;
-        const auto ads_end = high_resolution_clock::now();
+        // mostly lowercase letters, like text
+        std::string text(1 << 20, 'e');
+        for (size_t i = 0; i < text.size(); i++)
+                text[i] = i % 7 == 0 ? ' ' : i % 61 == 0 ? '.' : i % 97 == 0 ? 'T' : 'a' + i * 13 % 26;
+
+        const int64_t hn = 1 << 20;
+        const int64_t an = 1 << 20;
+        const int64_t gn = 1 << 20;
+
+        std::vector<int64_t> unsorted(1 << 20);
+        for (size_t i = 0; i < unsorted.size(); i++) unsorted[i] = i * 2654435761 % 1000003;
+        std::vector<int64_t> sorted(unsorted.size());
+
+        // sorts a fresh copy of 'unsorted', returns an element to compare
+        const auto sort_copy = [&](auto f) {
+                sorted = unsorted;
+                f(sorted.data(), 0, sorted.size() - 1);
+                return sorted[sorted.size() / 3];
+        };
+
+        // volatile, so the calls in apply_n stay indirect
+        int64_t (*volatile cxx_fp)(int64_t) = cxx_square;
+        int64_t (*volatile ads_fp)(int64_t) = ads_square;
+
+        check("fib", cxx_fib(fr), ads_fib(fr));
+        check("sum", cxx_sum(arr.data(), arr.size()), ads_sum(arr.data(), arr.size(), 0));
+        check("count_char", cxx_count_char(str.data(), 'a'), ads_count_char(&str[0], 'a', 0, 0));
+        check("apply", apply_n(cxx_fp, an), apply_n(ads_fp, an));
+        check("classify", cxx_classify(text.data()), ads_classify(&text[0], 0, 0));
+        check("generator", cxx_sum_squares(gn), ads_sum_squares(gn));
+        check("pfib", cxx_fib(fr), ads_pfib(fr));
+        check("qsort", sort_copy(cxx_quicksort), sort_copy(ads_quicksort));
+        check("pqsort", sort_copy(cxx_quicksort), sort_copy(ads_pquicksort));
+        if (!std::is_sorted(sorted.begin(), sorted.end())) {
+                std::cerr << "pqsort: not sorted" << std::endl;
+                return 1;
+        }
+
+        std::vector<Result> results = {
+                run("fib", "C++", [&] { return cxx_fib(fr); }),
+                run("fib", "Adscript", [&] { return ads_fib(fr); }),
+                run("fib", "spawn", [&] { return ads_pfib(fr); }),
+                run("sum", "C++", [&] { return cxx_sum(arr.data(), arr.size()); }),
+                run("sum", "Adscript", [&] { return ads_sum(arr.data(), arr.size(), 0); }),
+                run("count_char", "C++", [&] { return cxx_count_char(str.data(), 'a'); }),
+                run("count_char", "Adscript", [&] { return ads_count_char(&str[0], 'a', 0, 0); }),
+                run("harmonic", "C++", [&] { return cxx_harmonic(hn); }),
+                run("harmonic", "Adscript", [&] { return ads_harmonic(hn, 0); }),
+                run("apply", "C++", [&] { return apply_n(cxx_fp, an); }),
+                run("apply", "Adscript", [&] { return apply_n(ads_fp, an); }),
+                run("classify", "C++", [&] { return cxx_classify(text.data()); }),
+                run("classify", "Adscript", [&] { return ads_classify(&text[0], 0, 0); }),
+                run("generator", "C++", [&] { return cxx_sum_squares(gn); }),
+                run("generator", "Adscript", [&] { return ads_sum_squares(gn); }),
+                run("qsort", "C++", [&] { return sort_copy(cxx_quicksort); }),
+                run("qsort", "Adscript", [&] { return sort_copy(ads_quicksort); }),
+                run("qsort", "spawn", [&] { return sort_copy(ads_pquicksort); }),
+        };
+
+        if (csv) {
+                std::cout << "benchmark,impl,median_ns,p95_ns,min_ns" << std::endl;
+                for (auto &r : results)
+                        std::cout << r.name << "," << r.impl << "," << (int64_t) r.median << ","
+                                  << (int64_t) r.p95 << "," << (int64_t) r.min << std::endl;
+                return 0;
+        }
 
-        print_result("Fib C++\t\t\t", cxx_start, cxx_end);
-        print_result("Fib Adscript\t\t", ads_start, ads_end);
+        std::cout << "(" << warmups << " warmups, " << reps << " repetitions)" << std::endl;
+        std::cout << "benchmark\timpl\t\tmedian µs\tp95 µs" << std::endl;
+        for (auto &r : results)
+                std::cout << r.name << (r.name.size() < 8 ? "\t\t" : "\t") << r.impl
+                          << (r.impl.size() < 8 ? "\t\t" : "\t") << r.median / 1000 << "\t\t"
+                          << r.p95 / 1000 << std::endl;
 }
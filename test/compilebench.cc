@@ -0,0 +1,181 @@
+// measures how the compiler scales with the size of its input, using
+// synthetic programs generated by generate()
+
+#include "../src/utils.hh"
+#include "../src/compiler.hh"
+#include "../src/lexerparser.hh"
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <sstream>
+#include <iostream>
+
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include <llvm/IR/Module.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/Support/Host.h>
+
+using namespace Adscript;
+
+// a program with 'size' functions, each of them with a deeply nested
+// expression, a string literal, an array, a few lambdas and macro calls, as
+// well as a string literal and an array that grow with 'size'
+std::string generate(int64_t size) {
+        std::ostringstream s;
+
+        s << ";; generated by test/compilebench.out --generate " << size << "\n";
+        s << "(defn f0 [i64 a i64 b] i64 (+ a b))\n";
+        s << "(defmacro twice [x] `(+ ~x ~x))\n";
+
+        for (int64_t i = 1; i <= size; i++) {
+                s << "(defn f" << i << " [i64 a i64 b] i64\n";
+
+                s << "    (var str \"";
+                for (int j = 0; j < 256; j++) s << (char) ('a' + (i + j) % 26);
+                s << "\")\n";
+
+                s << "    (var arr #[";
+                for (int j = 0; j < 64; j++) s << (i * j) % 1000 << " ";
+                s << "])\n";
+
+                s << "    (var l ((fn [i64 x] i64 (* x " << i << ")) a))\n";
+                s << "    (set l (+ l ((fn [i64 x i64 y] i64 (- x y)) b (arr 3))))\n";
+
+                s << "    (set l (+ l";
+                for (int j = 0; j < 8; j++) s << " (twice " << (j % 2 ? "a" : "b") << ")";
+                s << "))\n";
+
+                s << "    ";
+                const int depth = 16;
+                for (int j = 0; j < depth; j++)
+                        s << (j % 2 ? "(if (< a " : "(+ b ") << j << (j % 2 ? ") " : " ");
+                s << "(f" << i - 1 << " a l)";
+                for (int j = depth - 1; j >= 0; j--) s << (j % 2 ? " b)" : ")");
+                s << ")\n";
+        }
+
+        s << "(defn big_str i8* \"";
+        for (int64_t i = 0; i < size * 16; i++) s << (char) ('a' + i % 26);
+        s << "\")\n";
+
+        s << "(defn big_arr [i64 i] i64 (var arr #[";
+        for (int64_t i = 0; i < size * 8; i++) s << i << " ";
+        s << "]) (arr i))\n";
+
+        return s.str();
+}
+
+using std::chrono::steady_clock;
+using std::chrono::microseconds;
+using std::chrono::duration_cast;
+
+struct Phase {
+        const char *name;
+        double ms;
+        long peakRSS;
+};
+
+// peak resident set size of the process in KiB
+long peakRSS() {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+        return ru.ru_maxrss / 1024;
+#else
+        return ru.ru_maxrss;
+#endif
+}
+
+template <class F>
+Phase measure(const char *name, F f) {
+        const auto start = steady_clock::now();
+        f();
+        const auto end = steady_clock::now();
+        return { name, duration_cast<microseconds>(end - start).count() / 1000.0, peakRSS() };
+}
+
+// runs in its own process, so the peak rss only covers one size
+void bench(int64_t size, bool csv) {
+        const std::string src = generate(size);
+        const std::u32string text = std::stou32(src);
+
+        std::vector<AST::Expr*> exprs;
+        llvm::LLVMContext ctx;
+        llvm::Module mod("compilebench", ctx);
+        llvm::IRBuilder<> builder(ctx);
+
+        Compiler::Options opts;
+        opts.target = llvm::sys::getDefaultTargetTriple();
+
+        std::vector<Phase> phases = {
+                measure("lex", [&] {
+                        Lexer lexer(text);
+                        while (lexer.nextT() != Lexer::TT_EOF);
+                }),
+                measure("parse", [&] {
+                        Parser parser((Lexer(text)));
+                        exprs = parser.parse();
+                }),
+                measure("codegen", [&] {
+                        Compiler::Context cctx(&mod, &builder, opts);
+                        for (auto &expr : exprs) expr->llvmValue(cctx);
+                }),
+                measure("emit", [&] {
+                        Compiler::compileModuleToFile(&mod, "/dev/null", opts.target);
+                }),
+        };
+
+        for (auto &p : phases) {
+                if (csv)
+                        std::cout << size << "," << src.size() << "," << p.name << "," << p.ms
+                                  << "," << p.peakRSS << std::endl;
+                else
+                        std::cout << size << "\t" << src.size() << "\t\t" << p.name << "\t\t"
+                                  << p.ms << "\t\t" << p.peakRSS << std::endl;
+        }
+}
+
+int main(int argc, char **argv) {
+        bool csv = false;
+        std::vector<int64_t> sizes;
+
+        for (int i = 1; i < argc; i++) {
+                if (!strcmp(argv[i], "--csv")) csv = true;
+                else if (!strcmp(argv[i], "--generate") && i + 1 < argc) {
+                        std::cout << generate(atol(argv[++i]));
+                        return 0;
+                } else if (atol(argv[i]) > 0) sizes.push_back(atol(argv[i]));
+                else {
+                        std::cerr << "usage: " << argv[0] << " [--csv] [<sizes>]" << std::endl
+                                  << "       " << argv[0] << " --generate <size>" << std::endl;
+                        return 1;
+                }
+        }
+
+        if (sizes.empty()) sizes = { 125, 250, 500, 1000, 2000 };
+
+        if (csv) std::cout << "size,bytes,phase,ms,peak_rss_kib" << std::endl;
+        else std::cout << "size\tbytes\t\tphase\t\tms\t\tpeak RSS (KiB)" << std::endl;
+
+        for (auto size : sizes) {
+                std::cout.flush();
+
+                pid_t pid = fork();
+                if (pid < 0) {
+                        perror("fork");
+                        return 1;
+                } else if (!pid) {
+                        bench(size, csv);
+                        exit(0);
+                }
+
+                int status;
+                waitpid(pid, &status, 0);
+                if (!WIFEXITED(status) || WEXITSTATUS(status)) return 1;
+        }
+}
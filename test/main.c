@@ -13,12 +13,38 @@ int not_fine(int (*a)()) {
     return a();
 }
 
+struct rec {
+    int64_t c;
+    int8_t b;
+    int64_t a;
+};
+
+struct particles {
+    float *x;
+    float *vx;
+    int32_t *id;
+};
+
 int64_t test1();
 int64_t test2();
 bool test3(bool);
 void test4(int64_t *i);
 void test5();
 int test6();
+int64_t test7(struct rec *r);
+int64_t test8(struct particles *ps, char *buf, int64_t n);
+int64_t advance_all(struct particles *ps, int64_t i, int64_t n);
+int64_t test9(int64_t k, int64_t n);
+int64_t test10(int64_t *a, int64_t *b, int64_t n);
+int64_t test11(int64_t n);
+int64_t test12(int64_t *counter, int64_t n);
+int64_t test13(int64_t n);
+int64_t test14(int64_t *log, int64_t *len, int64_t n);
+int64_t test15(int64_t a, int64_t b);
+int64_t test16(int64_t a, int64_t b);
+double test17(int64_t a, double b, double *xs);
+int64_t test18(int64_t *a, int64_t *b, int64_t x);
+int64_t test19(int64_t n);
 
 int main() {
     assert(test1() == 66);
@@ -38,6 +64,48 @@ int main() {
     puts("Test 5 passed.");
     assert(test6() == 1337);
     puts("Test 6 passed.");
+    struct rec r = { 2, 0, 1 };
+    assert(test7(&r) == 1 + 2 + 16 + 24 && r.b == 7);
+    puts("Test 7 passed.");
+    struct particles ps;
+    _Alignas(64) char buf[3 * 64];
+    assert(test8(&ps, buf, 10) == 3 * 64 - 2 * 12);
+    assert((char*)ps.vx == buf + 64 && (char*)ps.id == buf + 128);
+    for (int i = 0; i < 10; i++) ps.x[i] = i, ps.vx[i] = 1;
+    advance_all(&ps, 0, 10);
+    for (int i = 0; i < 10; i++) assert(ps.x[i] == i + 1);
+    puts("Test 8 passed.");
+    assert(test9(3, 10) == 3 * 45);
+    puts("Test 9 passed.");
+    static int64_t a[100000], b[100000];
+    assert(test10(a, b, 100000) == 2 * 99999 + 1);
+    for (int i = 0; i < 100000; i++) assert(b[i] == 2 * i + 1);
+    puts("Test 10 passed.");
+    assert(test11(25) == 75025);
+    puts("Test 11 passed.");
+    int64_t counter = 0;
+    assert(test12(&counter, 1000) == 1001 && counter == 1);
+    puts("Test 12 passed.");
+    assert(test13(1000) == 1000 * 999 / 2);
+    puts("Test 13 passed.");
+    int64_t log[8], len = 0;
+    // 'log_after' waits while 'upto' yields 4 times before it logs
+    assert(test14(log, &len, 4) == 4 * 3 / 2 + 4 && len == 8);
+    assert(log[0] == 1 && log[3] == 1 && log[4] == 2 && log[7] == 2);
+    puts("Test 14 passed.");
+    assert(test15(0xff, 7) == 11);
+    puts("Test 15 passed.");
+    assert(test16(2, 3) == 65);
+    puts("Test 16 passed.");
+    double xs[] = {0.5, 1.5, 2.5};
+    assert(test17(2, 1.0, xs) == 4.5 + 1.5 + 3 + 6);
+    puts("Test 17 passed.");
+    int64_t u[] = {1, 2, 3, 4}, v[] = {5, 6, 7, 8};
+    assert(test18(u, v, 2) == 70 + 27 - 40);
+    puts("Test 18 passed.");
+    // the loop body declares a variable and an array, the stack must not grow
+    assert(test19(10000000) == 10000000LL * 9999999);
+    puts("Test 19 passed.");
 
     return 0;
 }
@@ -0,0 +1,211 @@
+// measures the queues of the runtime library (runtime/queue.c) against a ring
+// buffer protected by a mutex: throughput of producer and consumer threads
+// passing values through a queue, and the latency of a round trip between two
+// threads
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <stdint.h>
+
+extern "C" void *adscript_spsc_new(int64_t);
+extern "C" int64_t adscript_spsc_push(void*, int64_t);
+extern "C" int64_t adscript_spsc_pop(void*, int64_t*);
+extern "C" int64_t adscript_spsc_free(void*);
+extern "C" void *adscript_mpmc_new(int64_t);
+extern "C" int64_t adscript_mpmc_push(void*, int64_t);
+extern "C" int64_t adscript_mpmc_pop(void*, int64_t*);
+extern "C" int64_t adscript_mpmc_free(void*);
+
+struct Spsc {
+        void *q;
+        Spsc(int64_t capacity) : q(adscript_spsc_new(capacity)) {}
+        ~Spsc() { adscript_spsc_free(q); }
+        bool push(int64_t v) { return adscript_spsc_push(q, v); }
+        bool pop(int64_t *v) { return adscript_spsc_pop(q, v); }
+};
+
+struct Mpmc {
+        void *q;
+        Mpmc(int64_t capacity) : q(adscript_mpmc_new(capacity)) {}
+        ~Mpmc() { adscript_mpmc_free(q); }
+        bool push(int64_t v) { return adscript_mpmc_push(q, v); }
+        bool pop(int64_t *v) { return adscript_mpmc_pop(q, v); }
+};
+
+// the baseline
+struct Mutex {
+        std::mutex m;
+        std::vector<int64_t> slots;
+        size_t head = 0, tail = 0;
+
+        Mutex(int64_t capacity) : slots(capacity) {}
+
+        bool push(int64_t v) {
+                std::lock_guard<std::mutex> lock(m);
+                if (tail - head == slots.size()) return false;
+                slots[tail++ % slots.size()] = v;
+                return true;
+        }
+
+        bool pop(int64_t *v) {
+                std::lock_guard<std::mutex> lock(m);
+                if (tail == head) return false;
+                *v = slots[head++ % slots.size()];
+                return true;
+        }
+};
+
+using std::chrono::nanoseconds;
+using std::chrono::duration_cast;
+using std::chrono::steady_clock;
+
+struct Result {
+        std::string name, impl;
+        // millions of values per second or nanoseconds per round trip
+        double median, p95;
+        const char *unit;
+};
+
+int reps = 10;
+int64_t ops = 1 << 20;
+const int64_t capacity = 1024;
+
+// the threads spin (yielding) while the queue is full or empty
+template <class Q>
+void push(Q &q, int64_t v) {
+        while (!q.push(v)) std::this_thread::yield();
+}
+
+template <class Q>
+int64_t pop(Q &q) {
+        int64_t v;
+        while (!q.pop(&v)) std::this_thread::yield();
+        return v;
+}
+
+// nanoseconds 'producers' threads need to push 'ops' values each to
+// 'consumers' threads, exits if values got lost
+template <class Q>
+double throughput(int producers, int consumers) {
+        Q q(capacity);
+        std::vector<int64_t> sums(consumers);
+        const int64_t total = ops * producers;
+
+        const auto start = steady_clock::now();
+
+        std::vector<std::thread> threads;
+        for (int i = 0; i < producers; i++)
+                threads.emplace_back([&] {
+                        for (int64_t j = 1; j <= ops; j++) push(q, j);
+                });
+        for (int i = 0; i < consumers; i++)
+                threads.emplace_back([&, i] {
+                        // every consumer takes the same share
+                        for (int64_t j = 0; j < total / consumers; j++) sums[i] += pop(q);
+                });
+        for (auto &t : threads) t.join();
+
+        const auto end = steady_clock::now();
+
+        int64_t sum = 0;
+        for (auto s : sums) sum += s;
+        if (sum != producers * (ops * (ops + 1) / 2)) {
+                std::cerr << "values got lost" << std::endl;
+                exit(1);
+        }
+
+        return duration_cast<nanoseconds>(end - start).count();
+}
+
+// nanoseconds a value needs to get to another thread and back, through two
+// queues
+template <class Q>
+double roundTrip() {
+        Q there(capacity), back(capacity);
+        const int64_t n = ops / 16;
+
+        std::thread echo([&] {
+                for (int64_t i = 0; i < n; i++) push(back, pop(there));
+        });
+
+        const auto start = steady_clock::now();
+        for (int64_t i = 0; i < n; i++) {
+                push(there, i);
+                pop(back);
+        }
+        const auto end = steady_clock::now();
+
+        echo.join();
+        return (double) duration_cast<nanoseconds>(end - start).count() / n;
+}
+
+template <class F>
+Result run(const std::string &name, const std::string &impl, const char *unit, F f) {
+        std::vector<double> values;
+        for (int i = 0; i < reps; i++) values.push_back(f());
+
+        std::sort(values.begin(), values.end());
+
+        const size_t n = values.size();
+        const double median = n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+        const double p95 = values[std::min(n - 1, (size_t) (n * 0.95))];
+
+        return { name, impl, median, p95, unit };
+}
+
+// millions of values per second
+template <class Q>
+Result runThroughput(const std::string &name, const std::string &impl, int producers, int consumers) {
+        auto r = run(name, impl, "Mops/s", [&] { return throughput<Q>(producers, consumers); });
+        // the rates of the median and of the 95th percentile (slow) run
+        const double total = ops * producers;
+        r.median = total * 1000 / r.median;
+        r.p95 = total * 1000 / r.p95;
+        return r;
+}
+
+int main(int argc, char **argv) {
+        bool csv = false;
+        for (int i = 1; i < argc; i++) {
+                if (!strcmp(argv[i], "--csv")) csv = true;
+                else if (!strcmp(argv[i], "--reps") && i + 1 < argc) reps = atoi(argv[++i]);
+                else if (!strcmp(argv[i], "--ops") && i + 1 < argc) ops = atoll(argv[++i]);
+                else {
+                        std::cerr << "usage: " << argv[0] << " [--csv] [--reps <n>] [--ops <n>]" << std::endl;
+                        return 1;
+                }
+        }
+        if (reps < 1) reps = 1;
+        if (ops < 16) ops = 16;
+
+        std::vector<Result> results = {
+                runThroughput<Spsc>("1 to 1", "spsc", 1, 1),
+                runThroughput<Mpmc>("1 to 1", "mpmc", 1, 1),
+                runThroughput<Mutex>("1 to 1", "mutex", 1, 1),
+                runThroughput<Mpmc>("4 to 4", "mpmc", 4, 4),
+                runThroughput<Mutex>("4 to 4", "mutex", 4, 4),
+                run("round trip", "spsc", "ns", roundTrip<Spsc>),
+                run("round trip", "mpmc", "ns", roundTrip<Mpmc>),
+                run("round trip", "mutex", "ns", roundTrip<Mutex>),
+        };
+
+        if (csv) {
+                std::cout << "benchmark,impl,median,p95,unit" << std::endl;
+                for (auto &r : results)
+                        std::cout << r.name << "," << r.impl << "," << r.median << "," << r.p95
+                                  << "," << r.unit << std::endl;
+                return 0;
+        }
+
+        std::cout << "(" << reps << " repetitions, " << ops << " values per producer)" << std::endl;
+        std::cout << "benchmark\timpl\tmedian\t\tp95" << std::endl;
+        for (auto &r : results)
+                std::cout << r.name << (r.name.size() < 8 ? "\t\t" : "\t") << r.impl << "\t"
+                          << r.median << " " << r.unit << "\t" << r.p95 << " " << r.unit << std::endl;
+}